@@ -27,6 +27,8 @@ class MainWindow(QWidget):
         self.load_state()
         self.init_network()
         self.init_ui()
+        # Подписка на изменения: сервер присылает версию и изменённые записи вместо сигнала -1
+        self.send_command("subscribe")
         self.open_file()
         self.start_notification_timer()
 
@@ -231,16 +233,12 @@ class MainWindow(QWidget):
             cmd_length = len(cmd_bytes)
             self.sock.sendall(cmd_length.to_bytes(4, byteorder='little'))
             self.sock.sendall(cmd_bytes)
-            length_bytes = self.sock.recv(4)
-            if len(length_bytes) < 4:
-                raise ConnectionError("Не удалось получить длину ответа")
-            response_length = int.from_bytes(length_bytes, byteorder='little')
-            response = b''
-            while len(response) < response_length:
-                chunk = self.sock.recv(min(65536, response_length - len(response)))
-                if not chunk:
-                    raise ConnectionError("Соединение прервано во время получения данных")
-                response += chunk
+            response_length = int.from_bytes(self.recv_exact(4), byteorder='little', signed=True)
+            # Уведомления об изменениях могут прийти раньше ответа
+            while response_length in (-1, -2):
+                self.handle_db_notification(response_length)
+                response_length = int.from_bytes(self.recv_exact(4), byteorder='little', signed=True)
+            response = self.recv_exact(response_length)
             if command.find("print") is None:
                 print(response.decode('utf-8').strip())
             return response.decode('utf-8').strip()
@@ -248,6 +246,15 @@ class MainWindow(QWidget):
             self.set_status(f"Ошибка связи с сервером: {str(e)}", False)
             return None
 
+    def recv_exact(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.sock.recv(min(65536, length - len(data)))
+            if not chunk:
+                raise ConnectionError("Соединение прервано во время получения данных")
+            data += chunk
+        return data
+
     def open_file(self):
         fname = self.file_input.text().strip()
         if fname:
@@ -456,13 +463,50 @@ class MainWindow(QWidget):
             rlist, _, _ = select.select([self.sock], [], [], 0)
             if rlist:
                 peek = self.sock.recv(4, socket.MSG_PEEK)
-                if len(peek) == 4 and int.from_bytes(peek, 'little', signed=True) == -1:
+                code = int.from_bytes(peek, 'little', signed=True) if len(peek) == 4 else 0
+                if code in (-1, -2):
                     # Считать уведомление
-                    self.sock.recv(4)
-                    self.show_db_update_dialog()
+                    self.recv_exact(4)
+                    self.handle_db_notification(code)
         except Exception:
             pass
 
+    def handle_db_notification(self, code):
+        if code == -1:
+            self.show_db_update_dialog()
+            return
+        length = int.from_bytes(self.recv_exact(4), 'little', signed=True)
+        self.apply_db_changes(self.recv_exact(length).decode('utf-8'))
+
+    def apply_db_changes(self, payload):
+        # Первая строка: version=N inserted=1,2 updated=3 deleted=4 (или version=N reload), дальше новые строки записей
+        header, _, rows_text = payload.partition('\n')
+        parts = header.split()
+        fields = dict(part.split('=', 1) for part in parts if '=' in part)
+        if 'reload' in parts:
+            self.show_db_update_dialog()
+            return
+        ids = {key: [i for i in fields.get(key, '').split(',') if i] for key in ('inserted', 'updated', 'deleted')}
+        rows = {}
+        for line in rows_text.split('\n'):
+            cols = line.split('\t')
+            if len(cols) >= 5:
+                rows[cols[0]] = cols
+        # Обновляем только видимые строки таблицы, без повторного select+print
+        deleted = set(ids['deleted'])
+        for row_idx in reversed(range(self.table.rowCount())):
+            header_item = self.table.verticalHeaderItem(row_idx)
+            row_id = header_item.text() if header_item else None
+            if row_id in deleted:
+                self.table.removeRow(row_idx)
+            elif row_id in rows:
+                for col_idx, value in enumerate(rows[row_id][1:5]):
+                    item = QTableWidgetItem(value)
+                    item.setToolTip(value)
+                    self.table.setItem(row_idx, col_idx, item)
+        self.set_status(f"База данных изменена другим пользователем (версия {fields.get('version', '?')}): "
+                        f"добавлено {len(ids['inserted'])}, изменено {len(ids['updated'])}, удалено {len(ids['deleted'])}", False)
+
     def show_db_update_dialog(self):
         msg = QMessageBox(self)
         msg.setIcon(QMessageBox.Warning)
@@ -3,12 +3,20 @@
 #include <fstream>
 #include <string>
 #include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/un.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <cstring>
+#include <csignal>
 
 const wchar_t* HELP_INFO = LR"(/// Допустимые команды и их использование:
 /// 
@@ -20,13 +28,21 @@ const wchar_t* HELP_INFO = LR"(/// Допустимые команды и их 
 ///    | reconnect |                                                                          | Переподключение к серверу (все несохраненные данные пропадут) |
 ///    | exit      |                                                                          | Закрыть БД (все несохраненные данные пропадут)                |
 ///    | open      | <название файла>                                                         | Выбор файла базы данных                                       |
-///    | save      |                                                                          | Сохранение базы данных                                        |
+///    | save      | [wait]                                                                   | Сохранение базы данных (wait — дождаться записи на диск)      |
 ///    | select    | [id=<...> name=<...>, group=<...>, rating=<...>]                         | Выборка записей                                               |
 ///    | reselect  | [id=<...> name=<...>, group=<...>, rating=<...>]                         | Повторная выборка среди выбранных записей                     |
-///    | update    | <name=<...>, group=<...>, rating=<...>, info=<...>>                      | Редактирование выбранных записей (всех)                       |
-///    | remove    |                                                                          | Удаление выбранных записей                                    |
+///    | update    | <name=<...>, group=<...>, rating=<...>, info=<...>> [where <...>]        | Редактирование выбранных записей (всех) или по where          |
+///    | remove    | [where <...>]                                                            | Удаление выбранных записей или записей по where               |
+///    | begin     |                                                                          | Начало транзакции                                             |
+///    | commit    |                                                                          | Применение изменений транзакции (одна запись и оповещение)    |
+///    | rollback  |                                                                          | Отмена изменений транзакции                                   |
 ///    | add       | <фио>\t<группа>\t<оценка>\t<инфа>                                        | Добавление записи                                             |
 ///    | print     | [id, name, group, rating, info] [range=<...>] [sort <name/group/rating>] | Вывод выбранных записей                                       |
+///    | count     | [id=<...> name=<...>, group=<...>, rating=<...>]                         | Подсчёт записей без изменения выборки                         |
+///    | page      | <id/name/group/rating> [range=<...>] [id=<...> name=<...> ...]           | Страница записей в порядке поля без изменения выборки         |
+///    | memory    |                                                                          | Память по открытым файлам и состояние кэша сервера            |
+///    | cancel    |                                                                          | Прервать выполняющийся запрос (Ctrl+C во время ожидания)      |
+///    | trace     | on/off                                                                   | Трассировка запросов сеанса в trace_file сервера              |
 ///    +-----------+--------------------------------------------------------------------------+---------------------------------------------------------------+
 
 /// Пример допустимых значений для поиска по полям (select, reselect, update, remove):
@@ -58,59 +74,289 @@ const wchar_t* HELP_INFO = LR"(/// Допустимые команды и их 
 ///    +--------+----------------------------------------------------------------------------------+
 )";
 
-// Парсинг конфига
-std::map<std::string, std::string> read_config(const std::string& filename) {
-    std::ifstream file(filename);
-    std::map<std::string, std::string> config;
-    std::string line;
-    
-    while (std::getline(file, line)) {
-        size_t delim_pos = line.find('=');
-        if (delim_pos != std::string::npos) {
-            std::string key = line.substr(0, line.find_last_not_of(" \t", delim_pos - 1) + 1);
-            std::string value = line.substr(delim_pos + 1);
-            value.erase(0, value.find_first_not_of(" \t"));
-            config[key] = value;
+// Приём ровно length байт
+bool recv_all(int sock, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t bytesRead = recv(sock, data, length, 0);
+        if (bytesRead <= 0) return false;
+        data += bytesRead;
+        length -= bytesRead;
+    }
+    return true;
+}
+
+// Отправка команды кадром: длина в байтах, затем UTF-8
+bool send_command(int sock, const std::wstring& wmessage) {
+    std::string message = utf16_to_utf8(wmessage);
+    int msgLength = message.size();
+    message.insert(0, reinterpret_cast<const char*>(&msgLength), sizeof(int));
+    return send(sock, message.data(), message.size(), 0) == (ssize_t)message.size();
+}
+
+// Ctrl+C, пока команда ждёт ответа: серверу уходит команда cancel (кадр готов заранее — в обработчике сигнала только send).
+// Сервер отвечает на неё отдельно, после ответа на прерванную команду. В остальное время Ctrl+C завершает клиент
+volatile sig_atomic_t waiting_socket = -1;
+volatile sig_atomic_t cancels_sent = 0;
+void send_cancel(int signal) {
+    static const char frame[] = { 6, 0, 0, 0, 'c', 'a', 'n', 'c', 'e', 'l' }; // длина (int, little-endian) и команда
+    int sock = waiting_socket;
+    if (sock < 0) {
+        std::signal(signal, SIG_DFL);
+        std::raise(signal);
+        return;
+    }
+    if (send(sock, frame, sizeof(frame), MSG_NOSIGNAL) == (ssize_t)sizeof(frame)) cancels_sent = cancels_sent + 1;
+}
+
+// Чтение уведомления об изменении БД (код -1 уже прочитан или -2 с версией и изменёнными записями)
+std::wstring read_notification(int sock, int code) {
+    if (code == -1)
+        return L"База данных была изменена другим пользователем.";
+    int length = 0;
+    if (!recv_all(sock, reinterpret_cast<char*>(&length), sizeof(int)) || length < 0)
+        return L"База данных была изменена другим пользователем.";
+    std::string payload(length, '\0');
+    if (!recv_all(sock, &payload[0], length))
+        return L"База данных была изменена другим пользователем.";
+    // Первая строка: version=N inserted=1,2 updated=3 deleted=4 (или version=N reload)
+    std::istringstream header(payload.substr(0, payload.find('\n')));
+    std::string part, version = "?";
+    std::map<std::string, size_t> counts;
+    bool reload = false;
+    while (header >> part) {
+        size_t eq = part.find('=');
+        if (part == "reload") reload = true;
+        if (eq == std::string::npos) continue;
+        std::string key = part.substr(0, eq), value = part.substr(eq + 1);
+        if (key == "version") version = value;
+        else counts[key] = value.empty() ? 0 : std::count(value.begin(), value.end(), ',') + 1;
+    }
+    std::wstring text = L"База данных была изменена другим пользователем (версия " + utf8_to_utf16(version) + L"): ";
+    if (reload) return text + L"изменено слишком много записей.";
+    return text + L"добавлено " + std::to_wstring(counts["inserted"]) + L", изменено " + std::to_wstring(counts["updated"]) +
+           L", удалено " + std::to_wstring(counts["deleted"]) + L".";
+}
+
+// Включение общей памяти для больших ответов: сервер присылает дескриптор memfd вместе с ответом (SCM_RIGHTS)
+ShmRing* request_shm(int sock, size_t size, size_t& mapped, std::wstring& text) {
+    if (!send_command(sock, L"shm " + std::to_wstring(size))) return nullptr;
+    int length = 0;
+    iovec iov{ &length, sizeof(int) };
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (got <= 0 || (got < (ssize_t)sizeof(int) && !recv_all(sock, reinterpret_cast<char*>(&length) + got, sizeof(int) - got)) || length < 0)
+        return nullptr;
+    int fd = -1;
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    std::string payload(length, '\0');
+    if (!recv_all(sock, &payload[0], length)) {
+        if (fd >= 0) close(fd);
+        return nullptr;
+    }
+    text = utf8_to_utf16(payload);
+    if (fd < 0) return nullptr; // сервер отказал (например, подключение не через Unix-сокет)
+    mapped = sizeof(ShmRing) + size;
+    void* map = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return map == MAP_FAILED ? nullptr : static_cast<ShmRing*>(map);
+}
+
+// Чтение ответа на команду: уведомления, пришедшие раньше него, выводятся сразу;
+// ответ кадром -3 собирается по кускам из общей памяти
+bool read_response(int sock, ShmRing* ring, std::string& response) {
+    int respLength = 0;
+    while (true) {
+        if (!recv_all(sock, reinterpret_cast<char*>(&respLength), sizeof(int))) return false;
+        if (respLength != -1 && respLength != -2) break;
+        std::wcerr << L"\033[1;33m..." << read_notification(sock, respLength) << L" Повторите выборку или обновите данные.\033[0m\n";
+    }
+    if (respLength == -3) {
+        int total = 0;
+        if (!ring || !recv_all(sock, reinterpret_cast<char*>(&total), sizeof(int)) || total < 0) return false;
+        response.resize(total);
+        for (size_t done = 0; done < (size_t)total;) {
+            int chunk = 0;
+            if (!recv_all(sock, reinterpret_cast<char*>(&chunk), sizeof(int)) || chunk <= 0 || done + chunk > (size_t)total) return false;
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+            size_t pos = tail % ring->capacity;
+            size_t first = std::min((size_t)chunk, (size_t)(ring->capacity - pos));
+            std::memcpy(&response[done], ring->data() + pos, first);
+            std::memcpy(&response[done + first], ring->data(), chunk - first);
+            ring->tail.store(tail + chunk, std::memory_order_release);
+            done += chunk;
+        }
+        return true;
+    }
+    if (respLength < 0) return false;
+    response.resize(respLength);
+    return recv_all(sock, &response[0], respLength);
+}
+
+// Пакетный режим: команды отправляются подряд из отдельного потока, не дожидаясь ответов,
+// а ответы читаются и выводятся по порядку. Время каждой команды — от отправки (или от предыдущего
+// ответа, если она ждала в очереди сервера) до её ответа; тайминги и итог пишутся в stderr
+int run_batch(int sock, ShmRing* ring, std::wistream& input) {
+    std::vector<std::wstring> commands;
+    for (std::wstring line; std::getline(input, line);) {
+        if (!line.empty() && line.back() == L'\r') line.pop_back();
+        if (line == L"exit") break;
+        if (line.empty() || line[0] == L'#' || line == L"help" || line == L"clear" || line == L"reconnect") continue;
+        commands.push_back(line);
+    }
+
+    using Clock = std::chrono::steady_clock;
+    std::vector<Clock::time_point> sentAt(commands.size());
+    std::atomic<size_t> sentCount{0};
+    Clock::time_point start = Clock::now();
+    std::thread writer([&] {
+        for (size_t i = 0; i < commands.size(); ++i) {
+            sentAt[i] = Clock::now();
+            if (!send_command(sock, commands[i])) break;
+            sentCount.store(i + 1, std::memory_order_release);
+        }
+    });
+
+    size_t received = 0;
+    Clock::time_point previous = start;
+    std::wcerr << std::fixed << std::setprecision(3);
+    for (; received < commands.size(); ++received) {
+        std::string response;
+        if (!read_response(sock, ring, response)) {
+            std::wcerr << L"\033[1;31mСервер отключился\033[0m\n";
+            break;
         }
+        Clock::time_point now = Clock::now();
+        // Ответ мог прийти раньше, чем поток отправки отметил команду: ждём отметки, иначе sentAt[received] ещё не записан
+        while (sentCount.load(std::memory_order_acquire) <= received) std::this_thread::yield();
+        double ms = std::chrono::duration<double, std::milli>(now - std::max(previous, sentAt[received])).count();
+        previous = now;
+        std::wcout << utf8_to_utf16(response);
+        std::wcerr << L"[" << received + 1 << L"] " << ms << L" мс\t" << commands[received] << L"\n";
     }
-    
-    return config;
+    shutdown(sock, SHUT_RDWR); // разбудить поток отправки, если сервер отключился раньше
+    writer.join();
+    std::wcout.flush();
+
+    double total = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    std::wcerr << L"Команд: " << received << L" из " << commands.size() << L", всего: " << total << L" мс";
+    if (received)
+        std::wcerr << L", в среднем: " << total / received << L" мс, " << received * 1000.0 / total << L" команд/с";
+    std::wcerr << L"\n";
+    return received == commands.size() ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     std::locale::global(std::locale("en_US.UTF-8"));
     std::wcout.imbue(std::locale(std::wcout.getloc(), new NoWSeparator));
-    system("clear");
+    // client -f <файл> — пакетный режим (- вместо файла — команды из stdin)
+    std::wifstream batchFile;
+    std::wistream* batch = nullptr;
+    if (argc == 3 && std::string(argv[1]) == "-f") {
+        if (std::string(argv[2]) == "-") batch = &std::wcin;
+        else {
+            batchFile.open(argv[2]);
+            batchFile.imbue(std::locale());
+            if (!batchFile) {
+                std::wcerr << L"\033[1;31mНе удалось открыть файл " << utf8_to_utf16(argv[2]) << L"\033[0m\n";
+                return 1;
+            }
+            batch = &batchFile;
+        }
+    }
+    else if (argc != 1) {
+        std::wcerr << L"Использование: client [-f <файл команд> | -f -]\n";
+        return 1;
+    }
+    // В пакетном режиме stdout — только ответы сервера
+    std::wostream& log = batch ? std::wcerr : std::wcout;
+    if (!batch) system("clear");
+    // Ctrl+C во время ожидания ответа отменяет команду (recv после обработчика продолжается)
+    if (!batch) {
+        struct sigaction action = {};
+        action.sa_handler = send_cancel;
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGINT, &action, nullptr);
+    }
     std::map<std::string, std::string> config = read_config("client_config.ini");
     std::string server_ip = config["server_ip"];
     int port = std::stoi(config["port"]);
+    // Сервер на этой же машине: Unix-сокет вместо TCP и (по желанию) общая память для больших ответов
+    std::string unix_path = config["unix_socket"];
+    size_t shm_size = config.count("shm_size") ? std::stoul(config["shm_size"]) : 0;
 
     while (true) {
-        int clientSocket = socket(AF_INET, SOCK_STREAM, 0);
+        int clientSocket = socket(unix_path.empty() ? AF_INET : AF_UNIX, SOCK_STREAM, 0);
         if (clientSocket < 0) {
             std::wcerr << L"\033[1;31mОшибка создания сокета\033[0m\n";
             return 1;
         }
 
-        struct sockaddr_in serverAddr;
+        struct sockaddr_storage serverAddr;
+        socklen_t serverLen;
         std::memset(&serverAddr, 0, sizeof(serverAddr));
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(port);
-        if (inet_pton(AF_INET, server_ip.c_str(), &serverAddr.sin_addr) <= 0) {
-            std::wcerr << L"\033[1;31mНеверный адрес\033[0m\n";
-            close(clientSocket);
-            return 1;
+        if (!unix_path.empty()) {
+            struct sockaddr_un* unixAddr = (struct sockaddr_un*)&serverAddr;
+            unixAddr->sun_family = AF_UNIX;
+            std::strncpy(unixAddr->sun_path, unix_path.c_str(), sizeof(unixAddr->sun_path) - 1);
+            serverLen = sizeof(struct sockaddr_un);
+            log << L"Подключение к серверу " << utf8_to_utf16(unix_path) << L"...\n";
         }
-
-        std::wcout << L"Подключение к серверу " << utf8_to_utf16(server_ip) << L":" << port << L"...\n";
-        if (connect(clientSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) < 0) {
+        else {
+            struct sockaddr_in* inetAddr = (struct sockaddr_in*)&serverAddr;
+            inetAddr->sin_family = AF_INET;
+            inetAddr->sin_port = htons(port);
+            if (inet_pton(AF_INET, server_ip.c_str(), &inetAddr->sin_addr) <= 0) {
+                std::wcerr << L"\033[1;31mНеверный адрес\033[0m\n";
+                close(clientSocket);
+                return 1;
+            }
+            serverLen = sizeof(struct sockaddr_in);
+            log << L"Подключение к серверу " << utf8_to_utf16(server_ip) << L":" << port << L"...\n";
+        }
+        if (connect(clientSocket, (struct sockaddr*)&serverAddr, serverLen) < 0) {
+            if (batch) {
+                std::wcerr << L"\033[1;31mОшибка подключения\033[0m\n";
+                close(clientSocket);
+                return 1;
+            }
             std::wcerr << L"\033[1;31mОшибка подключения. Повторная попытка через 5 секунд...\033[0m\n";
             close(clientSocket);
             sleep(5);
             continue;
         }
 
-        std::wcout << L"Подключено к серверу!\n";
+        log << L"Подключено к серверу!\n";
+        // Подписываемся на изменения: сервер будет присылать версию и изменённые записи вместо простого сигнала
+        int subscribeLength = 0;
+        if (!send_command(clientSocket, L"subscribe") ||
+            !recv_all(clientSocket, reinterpret_cast<char*>(&subscribeLength), sizeof(int)) || subscribeLength < 0) {
+            std::wcerr << L"\033[1;31mОшибка подписки на изменения\033[0m\n";
+            close(clientSocket);
+            if (batch) return 1;
+            continue;
+        }
+        std::string subscribeResponse(subscribeLength, '\0');
+        recv_all(clientSocket, &subscribeResponse[0], subscribeLength);
+        ShmRing* ring = nullptr;
+        size_t ringBytes = 0;
+        if (shm_size && !unix_path.empty()) {
+            std::wstring shmResponse;
+            ring = request_shm(clientSocket, shm_size, ringBytes, shmResponse);
+            if (!ring) std::wcerr << L"\033[1;33m" << (shmResponse.empty() ? L"Общая память недоступна\n" : shmResponse) << L"\033[0m";
+        }
+        if (batch) {
+            int code = run_batch(clientSocket, ring, *batch);
+            if (ring) munmap(ring, ringBytes);
+            close(clientSocket);
+            return code;
+        }
 
         while (true) {
             std::wstring wmessage;
@@ -143,10 +389,11 @@ int main() {
             int ready = select(clientSocket + 1, &readfds, NULL, NULL, &tv);
             if (ready > 0 && FD_ISSET(clientSocket, &readfds)) {
                 ssize_t bytesReadPeek = recv(clientSocket, &respLengthPeek, sizeof(int), MSG_PEEK);
-                if (bytesReadPeek > 0 && respLengthPeek == -1) {
+                if (bytesReadPeek > 0 && (respLengthPeek == -1 || respLengthPeek == -2)) {
                     // Считать уведомление
                     recv(clientSocket, &respLengthPeek, sizeof(int), 0);
-                    std::wcerr << L"\033[1;33mБаза данных была изменена другим пользователем. Вы точно хотите выполнить эту команду? Результат может быть непредсказуемым. (y/n): \033[0m";
+                    std::wstring notification = read_notification(clientSocket, respLengthPeek);
+                    std::wcerr << L"\033[1;33m" << notification << L" Вы точно хотите выполнить эту команду? Результат может быть непредсказуемым. (y/n): \033[0m";
                     std::wstring confirm;
                     std::getline(std::wcin, confirm);
                     if (confirm != L"y" && confirm != L"Y" && confirm != L"д" && confirm != L"Д") {
@@ -156,50 +403,38 @@ int main() {
                 }
             }
 
-            // Конвертируем в UTF-8 для передачи
-            std::string message = utf16_to_utf8(wmessage);
-            int msgLength = message.size();  // Размер в байтах (не в символах!)
-            
-            if (send(clientSocket, &msgLength, sizeof(int), 0) < 0) {
-                std::wcerr << L"\033[1;31mОшибка отправки длины сообщения\033[0m\n";
-                break;
-            }
-
-            if (send(clientSocket, message.c_str(), msgLength, 0) < 0) {
+            // Конвертируем в UTF-8 и отправляем одним кадром (длина в байтах, не в символах!)
+            if (!send_command(clientSocket, wmessage)) {
                 std::wcerr << L"\033[1;31mОшибка отправки сообщения\033[0m\n";
                 break;
             }
 
-            // Получаем ответ
-            int respLength;
-            ssize_t bytesRead = recv(clientSocket, &respLength, sizeof(int), 0);
-            if (bytesRead <= 0) {
+            // Получаем ответ (уведомление могло прийти раньше него — оно выводится отдельно); Ctrl+C тем временем отменяет команду
+            std::string response;
+            cancels_sent = 0;
+            waiting_socket = clientSocket;
+            bool received = read_response(clientSocket, ring, response);
+            waiting_socket = -1;
+            if (!received) {
                 std::wcerr << L"\033[1;31mСервер отключился\033[0m\n";
+                close(clientSocket);
                 break;
             }
-            if (respLength == -1) {
-                std::wcerr << L"\033[1;33m...База данных была изменена другим пользователем. Повторите выборку или обновите данные.\033[0m\n";
-                continue;
-            }
-            char* buffer = new char[respLength + 1];
-            int totalReceived = 0;
-            while (totalReceived != respLength) {
-                bytesRead = recv(clientSocket, buffer + totalReceived, respLength - totalReceived, 0);
-                if (bytesRead <= 0) {
-                    std::wcerr << L"\033[1;31mОшибка получения ответа\033[0m\n";
-                    delete[] buffer;
-                    close(clientSocket);
-                    break;
-                }
-                totalReceived += bytesRead;
-            }
-            buffer[respLength] = '\0';
 
             // Конвертируем обратно в UTF-16
-            std::wstring wresponse = utf8_to_utf16(buffer);
+            std::wstring wresponse = utf8_to_utf16(response);
             std::wcout << L"\033[33m" << wresponse << L"\033[0m";
-            delete[] buffer;
+            // Ответы на отправленные cancel
+            for (int k = 0; k < cancels_sent && received; ++k)
+                if ((received = read_response(clientSocket, ring, response)))
+                    std::wcerr << L"\033[1;33m" << utf8_to_utf16(response) << L"\033[0m";
+            if (!received) {
+                std::wcerr << L"\033[1;31mСервер отключился\033[0m\n";
+                close(clientSocket);
+                break;
+            }
         }
+        if (ring) munmap(ring, ringBytes);
     }
 
     return 0;
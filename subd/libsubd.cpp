@@ -0,0 +1,150 @@
+#include "libsubd.h"
+#include "subd.h"
+#include <mutex>
+
+struct subd_db {
+    Database db;
+    std::string message;    // вывод последней операции (UTF-8)
+    RequestArena arena;     // временные массивы операции, освобождаются после неё
+};
+
+struct subd_result {
+    const Database* db;
+    std::vector<size_t> rows;
+};
+
+namespace {
+// Ядро сообщает о результатах в std::wcout, а он один на процесс: вывод операций перехватывается по очереди
+std::mutex outputMutex;
+
+// Выполнить операцию ядра, сохранив её вывод в db->message. Исключения через C-интерфейс не проходят:
+// при исключении возвращается onError, а в сообщение дописывается ошибка
+template <typename Result, typename Fn>
+Result captured(subd_db* db, Result onError, Fn fn) {
+    std::lock_guard<std::mutex> lock(outputMutex);
+    Result result = onError;
+    std::wstring output;
+    {
+        RequestArena::Scope operationMemory(db->arena);
+        WcoutRedirect redirect;
+        try {
+            result = fn();
+        }
+        catch (const std::bad_alloc&) {
+            std::wcout << L"Ошибка: недостаточно памяти\n";
+        }
+        catch (const std::exception&) {
+            std::wcout << L"Ошибка: некорректная команда или критерии\n";
+        }
+        output = redirect.getOutput();
+    }
+    try { db->message = utf16_to_utf8(output); }
+    catch (...) { db->message.clear(); }
+    return result;
+}
+
+void fillRow(const Database::RowView& view, subd_row* row) {
+    row->id = view.id;
+    row->name = view.name;
+    row->group = view.group;
+    row->rating = view.rating;
+    row->info = view.info;
+}
+}
+
+void subd_configure(size_t parallel_threshold, size_t parallel_threads, const char* eager_indexes, int background_indexes) {
+    Database::setParallelism(parallel_threshold, parallel_threads);
+    Database::setIndexing(eager_indexes ? eager_indexes : "all", background_indexes != 0);
+}
+
+void subd_set_cache_budget(size_t bytes) {
+    Database::setCacheBudget(bytes);
+}
+
+subd_db* subd_create(void) {
+    try { return new subd_db(); }
+    catch (...) { return nullptr; }
+}
+
+void subd_destroy(subd_db* db) {
+    delete db;
+}
+
+const char* subd_message(const subd_db* db) {
+    return db->message.c_str();
+}
+
+int subd_open(subd_db* db, const char* path) {
+    return captured(db, -1, [&] { return db->db.selectDB(utf8_to_utf16(path)) ? 0 : -1; });
+}
+
+int subd_save(subd_db* db, int wait) {
+    return captured(db, -1, [&] { return db->db.saveDB(wait ? L"wait" : L"") ? 0 : -1; });
+}
+
+int subd_exec(subd_db* db, const char* command) {
+    return captured(db, -1, [&] { return db->db.parseCommand(command) ? 0 : -1; });
+}
+
+long subd_query(subd_db* db, const char* criteria, subd_row_callback callback, void* user) {
+    std::vector<size_t> rows;
+    if (captured(db, -1, [&] { return db->db.query(criteria, rows) ? 0 : -1; }) < 0)
+        return -1;
+    // Колбэк вызывается вне перехвата вывода: из него можно обращаться к библиотеке (но не менять эту базу)
+    long visited = 0;
+    subd_row row;
+    for (size_t index : rows) {
+        fillRow(db->db.row(index), &row);
+        ++visited;
+        if (!callback(&row, user)) break;
+    }
+    return visited;
+}
+
+subd_result* subd_select(subd_db* db, const char* criteria) {
+    return captured(db, (subd_result*)nullptr, [&] {
+        std::vector<size_t> rows;
+        if (!db->db.query(criteria, rows)) return (subd_result*)nullptr;
+        return new subd_result{ &db->db, std::move(rows) };
+    });
+}
+
+size_t subd_result_size(const subd_result* result) {
+    return result->rows.size();
+}
+
+int subd_result_row(const subd_result* result, size_t i, subd_row* row) {
+    if (i >= result->rows.size()) return -1;
+    fillRow(result->db->row(result->rows[i]), row);
+    return 0;
+}
+
+void subd_result_free(subd_result* result) {
+    delete result;
+}
+
+long subd_insert(subd_db* db, const subd_new_row* rows, size_t count) {
+    return captured(db, -1L, [&]() -> long {
+        // Сначала проверяем все записи, чтобы не добавить половину пачки
+        std::vector<std::wstring> names(count), infos(count);
+        for (size_t i = 0; i < count; ++i) {
+            names[i] = utf8_to_utf16(rows[i].name);
+            infos[i] = utf8_to_utf16(rows[i].info ? rows[i].info : "");
+            if (!validate_name(names[i]) || !validate_group(rows[i].group) || !validate_rating(rows[i].rating) ||
+                infos[i].find(L'\n') != std::wstring::npos) {
+                std::wcout << L"Ошибка: запись " << i + 1 << L" не прошла проверку (ФИО, группа, оценка или перевод строки в информации)\n";
+                return -1;
+            }
+        }
+        // Вся пачка — одна транзакция (если её уже не начали снаружи)
+        bool own = !db->db.transactionOpen();
+        if (own) {
+            db->db.begin();
+            if (!db->db.transactionOpen()) return -1;
+        }
+        for (size_t i = 0; i < count; ++i)
+            db->db.addStudent(names[i], rows[i].group, rows[i].rating, infos[i]);
+        if (own) db->db.commit();
+        return (long)count;
+    });
+}
@@ -0,0 +1,74 @@
+#pragma once
+// C-интерфейс ядра БД (libsubd): работа с базой прямо в процессе, без сервера и сокетов.
+// Строки на входе — UTF-8, строки записей на выходе — wchar_t прямо из памяти БД (без копирования).
+// Перед вызовами в процессе должна быть установлена локаль UTF-8 (setlocale(LC_ALL, "") или "en_US.UTF-8").
+// Один дескриптор нельзя использовать из нескольких потоков одновременно.
+#include <stddef.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct subd_db subd_db;         // Открытая база (экземпляр Database)
+typedef struct subd_result subd_result; // Результат выборки: номера записей
+
+// Запись для чтения: name и info указывают в память БД и действительны до следующего изменения базы
+typedef struct subd_row {
+    int id;
+    const wchar_t* name;
+    int group;
+    double rating;
+    const wchar_t* info;
+} subd_row;
+
+// Новая запись для subd_insert (строки UTF-8)
+typedef struct subd_new_row {
+    const char* name;
+    int group;
+    double rating;
+    const char* info;
+} subd_new_row;
+
+// Колбэк subd_query: вернуть 0, чтобы остановить обход
+typedef int (*subd_row_callback)(const subd_row* row, void* user);
+
+// Настройка параллельного выполнения и построения индексов (как в server_config.ini; до первого subd_open)
+void subd_configure(size_t parallel_threshold, size_t parallel_threads, const char* eager_indexes, int background_indexes);
+
+// Бюджет памяти кэша загруженных файлов в байтах (0 — без кэша, по умолчанию): повторное открытие
+// неизменённого файла копирует записи из памяти вместо разбора
+void subd_set_cache_budget(size_t bytes);
+
+// Создание и удаление дескриптора
+subd_db* subd_create(void);
+void subd_destroy(subd_db* db);
+
+// Текст, который вывела последняя операция (сообщения и ошибки, UTF-8); действителен до следующего вызова
+const char* subd_message(const subd_db* db);
+
+// Открытие файла базы (0 — успех, -1 — ошибка)
+int subd_open(subd_db* db, const char* path);
+
+// Сохранение базы (wait != 0 — дождаться записи на диск); 0 — успех, -1 — ошибка
+int subd_save(subd_db* db, int wait);
+
+// Выполнение текстовой команды (как у клиента: select, print, begin, commit, ...); 0 — успех, -1 — ошибка (текст — в subd_message)
+int subd_exec(subd_db* db, const char* command);
+
+// Обход записей по критериям (формат как у select: "group=101-103 rating=4-5"); число обойдённых записей или -1
+long subd_query(subd_db* db, const char* criteria, subd_row_callback callback, void* user);
+
+// Выборка по критериям для обхода по номерам (NULL — ошибка в критериях)
+subd_result* subd_select(subd_db* db, const char* criteria);
+size_t subd_result_size(const subd_result* result);
+int subd_result_row(const subd_result* result, size_t i, subd_row* row);   // 0 — успех, -1 — номер вне выборки
+void subd_result_free(subd_result* result);
+
+// Добавление записей: все проверяются заранее и добавляются одной транзакцией
+// (одна сортировка, одно перестроение индексов, одна запись файла); число добавленных или -1
+long subd_insert(subd_db* db, const subd_new_row* rows, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -4,7 +4,16 @@
 #include <sstream>
 #include <string>
 #include <map>
+#include <deque>
+#include <algorithm>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -14,79 +23,613 @@
 #include <mutex>
 #include <set>
 #include <unordered_map>
+#include <climits>
+#include <cerrno>
+#include <condition_variable>
+#include <chrono>
+#include <charconv>
+#include <atomic>
+#include <ctime>
 
-// Класс для временного перенаправления потока
-class WcoutRedirect {
-    std::wstreambuf* old_buf;
-    std::wstringstream buffer;
-    
-public:
-    WcoutRedirect() : old_buf(std::wcout.rdbuf()) {
-        std::wcout.rdbuf(buffer.rdbuf());
-    }
-    
-    ~WcoutRedirect() {
-        std::wcout.rdbuf(old_buf);
-    }
-    
-    std::wstring getOutput() const {
-        return buffer.str();
-    }
+// Накопленные для клиента изменения: склеиваются, пока не уйдут одним кадром
+struct PendingChanges {
+    size_t version = 0;                  // версия файла в последнем изменении
+    bool reload = false;                 // изменений слишком много — клиенту проще перечитать всё
+    std::map<int, char> state;           // id → 'i' (добавлена), 'u' (изменена), 'd' (удалена)
+    std::map<int, std::string> rows;     // новые строки добавленных/изменённых записей
+    size_t row_bytes = 0;                // сколько байт строк накоплено (с заменёнными — оценка сверху)
+};
+// Сеанс клиента на сервере
+struct ClientSession {
+    int sock = -1;
+    std::mutex send_mutex;               // ответы и уведомления пишутся в сокет целыми кадрами
+    bool closed = false;                 // сокет закрыт (номер может достаться новому клиенту), под send_mutex
+    bool subscribed = false;             // получает изменения (-2) вместо простого сигнала (-1), под notify_mutex
+    bool queued = false;                 // стоит в очереди на отправку уведомления, под notify_mutex
+    PendingChanges pending;              // под notify_mutex
+    ShmRing* ring = nullptr;             // буфер общей памяти для больших ответов (только Unix-сокет), под send_mutex
+    size_t ring_bytes = 0;               // размер отображения ring
+    size_t ring_capacity = 0;            // область данных ring (заголовок клиент может переписать — размер берём отсюда)
+    uint64_t ring_head = 0;              // сколько байт записано в ring (своя копия head по той же причине)
+    std::string outbox;                  // недописанный остаток кадра уведомления, под send_mutex
+    std::chrono::steady_clock::time_point outbox_progress; // когда кадр в последний раз продвинулся, под send_mutex
+    RequestControl control;              // отмена и срок текущего запроса
+    bool executing = false;              // запрос ждёт очереди или выполняется, под schedule_mutex
+    bool watching = false;               // поток отмены смотрит в сокет (следующий кадр ещё не прочитан), под schedule_mutex
+    bool cancel_read = false;            // поток отмены забрал команду cancel — ответить на неё после запроса, под schedule_mutex
+    size_t cancel_peeked = 0;            // сколько байт начала кадра cancel уже видел поток отмены, под schedule_mutex
+    bool holds_slot = false;             // запрос занимает место длинного, под schedule_mutex
+    bool tracing = false;                // команда trace on: все запросы сеанса пишутся в trace_file
+    bool trace_named = false;            // в trace_file уже записано имя потока сеанса, под trace_mutex
 };
 
-// Парсинг конфига
-std::map<std::string, std::string> read_config(const std::string& filename) {
-    std::ifstream file(filename);
-    std::map<std::string, std::string> config;
-    std::string line;
-    
-    while (std::getline(file, line)) {
-        size_t delim_pos = line.find('=');
-        if (delim_pos != std::string::npos) {
-            std::string key = line.substr(0, line.find_last_not_of(" \t", delim_pos - 1) + 1);
-            std::string value = line.substr(delim_pos + 1);
-            value.erase(0, value.find_first_not_of(" \t"));
-            config[key] = value;
-        }
-    }
-    
-    return config;
-}
+size_t shm_threshold = 65536;            // ответы от этого размера идут через общую память (если клиент её включил)
+size_t shm_max_size = 64 << 20;          // наибольший буфер, который может попросить клиент
 
 std::unordered_map<std::wstring, std::shared_ptr<Database>> db_map;
 std::mutex db_map_mutex;
-std::set<int> client_sockets;
+std::unordered_map<int, std::shared_ptr<ClientSession>> sessions;
 std::mutex clients_mutex;
 std::unordered_map<std::wstring, std::set<int>> file_clients_map;
 
 // Для каждого файла: массив экземпляров Database
 std::unordered_map<std::wstring, std::vector<std::shared_ptr<Database>>> db_instances_map;
 
-void notify_clients_db_update(const std::wstring& filename) {
-    std::lock_guard<std::mutex> lock(clients_mutex);
-    auto it = file_clients_map.find(filename);
-    if (it != file_clients_map.end()) {
-        for (int sock : it->second) {
-            int update_code = -1; // специальный код для "БД обновлена"
-            send(sock, &update_code, sizeof(int), 0);
+// Очередь уведомлений об изменениях (разбирается потоком notification_loop)
+std::mutex notify_mutex;
+std::condition_variable notify_cv;
+std::vector<std::shared_ptr<ClientSession>> notify_queue;
+std::unordered_map<std::wstring, size_t> file_versions; // версия каждого файла, общая для всех сеансов
+const size_t notify_max_ids = 10000;                     // больше изменённых id — отправляем reload
+const size_t notify_max_bytes = 1 << 20;                 // больше байт новых строк — тоже reload
+std::chrono::milliseconds notify_drop_timeout(10000);    // кадр не продвигается дольше — клиент отключается
+const size_t response_keep_bytes = 4 << 20;              // буфер ответа больше этого после отправки не держим
+
+// Планировщик запросов: перед выполнением команда получает оценку стоимости (сколько записей пройдёт).
+// Короткие (до short_cost) выполняются сразу — точечные запросы не ждут за длинными проходами. Длинных одновременно
+// не больше long_slots, остальные ждут в порядке поступления: у клиента в работе одна команда, поэтому очередь честна
+// между клиентами. Срок запроса (request_timeout) отсчитывается с его получения, ожидание в очереди в него входит
+size_t short_cost = 100000;                              // оценка в записях, до которой запрос короткий
+size_t long_slots = 1;                                   // сколько длинных запросов выполняются одновременно
+std::chrono::milliseconds request_timeout(0);            // срок выполнения запроса (0 — без срока)
+std::mutex schedule_mutex;
+std::condition_variable schedule_cv;
+std::deque<ClientSession*> long_queue;                   // длинные запросы, ждущие места
+size_t long_running = 0;
+std::vector<std::shared_ptr<ClientSession>> watched_sessions; // сеансы с запросом в работе (их сокеты смотрит поток отмены)
+int cancel_wakeup = -1;                                  // eventfd: набор наблюдаемых сокетов изменился
+
+// Трассировка запросов: этапы выбранных запросов пишутся в trace_file в формате Chrome trace-event (JSON-массив
+// событий, открывается в chrome://tracing и Perfetto). Трассируется каждый trace_sample-й запрос и все запросы сеансов
+// с trace on. Запросы дольше slow_query_time попадают в журнал медленных запросов с разбивкой по этапам
+std::mutex trace_mutex;
+std::ofstream trace_out;                                 // открыт, если задан trace_file
+bool trace_started = false;                              // в trace_file уже есть событие (следующие — через запятую)
+size_t trace_sample = 0;                                 // трассировать каждый N-й запрос (0 — только сеансы с trace on)
+std::atomic<size_t> trace_counter{ 0 };
+std::chrono::milliseconds slow_query_time(0);            // порог медленного запроса (0 — журнал выключен)
+std::ofstream slow_out;                                  // журнал медленных запросов (не задан — пишется в stderr)
+const auto trace_epoch = std::chrono::steady_clock::now(); // начало отсчёта меток времени в trace_file
+
+// Отправка всего буфера (send может отправить только часть)
+bool send_all(int sock, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(sock, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// Поставить изменения в очередь всем клиентам с этим файлом, кроме инициатора (nullptr — запись извне).
+// Вызывается из потока, который сохранил БД, поэтому здесь нет отправки в сокеты — только склейка.
+// Инициатор — сеанс, а не номер сокета: к моменту записи он мог отключиться, а номер — достаться новому клиенту
+void notify_clients_db_update(const std::wstring& filename, const ClientSession* initiator, const Database::ChangeSet& changes) {
+    std::vector<std::shared_ptr<ClientSession>> targets;
+    {
+        std::lock_guard<std::mutex> lock(clients_mutex);
+        auto it = file_clients_map.find(filename);
+        if (it == file_clients_map.end()) return;
+        for (int sock : it->second)
+            if (auto session = sessions.find(sock); session != sessions.end() && session->second.get() != initiator)
+                targets.push_back(session->second);
+    }
+    std::map<int, const std::string*> rows; // строка по id (id - первое поле строки)
+    for (const auto& line : changes.rows) rows[std::atoi(line.c_str())] = &line;
+
+    std::lock_guard<std::mutex> lock(notify_mutex);
+    size_t version = ++file_versions[filename];
+    for (auto& session : targets) {
+        PendingChanges& pending = session->pending;
+        pending.version = version;
+        if (changes.reload) {
+            pending.reload = true;
+            pending.state.clear();
+            pending.rows.clear();
+        }
+        if (!pending.reload) {
+            for (int id : changes.inserted) {
+                pending.state[id] = pending.state.count(id) ? 'u' : 'i';
+                if (auto row = rows.find(id); row != rows.end()) pending.rows[id] = *row->second;
+            }
+            for (int id : changes.updated) {
+                if (auto st = pending.state.find(id); st == pending.state.end() || st->second != 'i') pending.state[id] = 'u';
+                if (auto row = rows.find(id); row != rows.end()) pending.rows[id] = *row->second;
+            }
+            for (int id : changes.deleted) {
+                // Добавленная и удалённая в одном окне запись клиенту не интересна
+                if (auto st = pending.state.find(id); st != pending.state.end() && st->second == 'i') pending.state.erase(st);
+                else pending.state[id] = 'd';
+                pending.rows.erase(id);
+            }
+            for (int id : changes.inserted) pending.row_bytes += rows.count(id) ? rows[id]->size() : 0;
+            for (int id : changes.updated) pending.row_bytes += rows.count(id) ? rows[id]->size() : 0;
+            // Клиент не успевает читать: вместо растущего списка изменений он получит reload
+            if (pending.state.size() > notify_max_ids || pending.row_bytes > notify_max_bytes) {
+                pending.reload = true;
+                pending.state.clear();
+                pending.rows.clear();
+            }
+        }
+        if (!session->queued) {
+            session->queued = true;
+            notify_queue.push_back(session);
+        }
+    }
+    notify_cv.notify_one();
+}
+
+// Кадр уведомления. Без подписки: int -1. С подпиской: int -2, int длина, текст
+// "version=N inserted=1,2 updated=3 deleted=4\n" и строки добавленных/изменённых записей (или "version=N reload\n")
+std::string build_notification(const ClientSession& session) {
+    int code = session.subscribed ? -2 : -1;
+    std::string frame(reinterpret_cast<const char*>(&code), sizeof(int));
+    if (!session.subscribed) return frame;
+    const PendingChanges& pending = session.pending;
+    std::string payload = "version=" + std::to_string(pending.version);
+    if (pending.reload) {
+        payload += " reload\n";
+    }
+    else {
+        for (char kind : { 'i', 'u', 'd' }) {
+            payload += kind == 'i' ? " inserted=" : kind == 'u' ? " updated=" : " deleted=";
+            bool first = true;
+            for (const auto& [id, st] : pending.state) {
+                if (st != kind) continue;
+                if (!first) payload += ',';
+                payload += std::to_string(id);
+                first = false;
+            }
+        }
+        payload += '\n';
+        for (const auto& [id, line] : pending.rows) payload += line;
+    }
+    int length = payload.size();
+    frame.append(reinterpret_cast<const char*>(&length), sizeof(int));
+    return frame + payload;
+}
+
+// Дописать остаток кадра уведомления перед ответом (под send_mutex): ответ не должен разорвать кадр
+bool flush_outbox(ClientSession& session) {
+    if (session.outbox.empty()) return true;
+    bool sent = send_all(session.sock, session.outbox.data(), session.outbox.size());
+    session.outbox.clear();
+    return sent;
+}
+
+// Отправка уведомлений одному сеансу без ожидания: кадр пишется, пока сокет принимает, остаток ждёт следующего прохода.
+// true — сеансу больше нечего отправлять
+bool deliver_notifications(ClientSession& session, std::chrono::steady_clock::time_point now) {
+    std::unique_lock<std::mutex> sending(session.send_mutex, std::try_to_lock);
+    if (!sending.owns_lock()) return false; // сеанс отправляет свой ответ — попробуем на следующем проходе
+    if (session.closed) return true;
+    while (true) {
+        if (session.outbox.empty()) {
+            std::lock_guard<std::mutex> lock(notify_mutex);
+            if (!session.queued) return true;
+            session.outbox = build_notification(session);
+            session.pending = PendingChanges{};
+            session.queued = false;
+            session.outbox_progress = now;
+        }
+        ssize_t sent = send(session.sock, session.outbox.data(), session.outbox.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (sent <= 0) { // соединение разорвано — сеанс завершится сам
+            session.outbox.clear();
+            return true;
+        }
+        session.outbox.erase(0, sent);
+        session.outbox_progress = now;
+    }
+    if (now - session.outbox_progress < notify_drop_timeout) return false;
+    // Клиент давно не читает: отключаем его, поток сеанса увидит разрыв и уберёт сеанс
+    std::wcerr << L"\033[1;31mКлиент не читает уведомления, соединение закрыто\033[0m\n";
+    shutdown(session.sock, SHUT_RDWR);
+    session.outbox.clear();
+    return true;
+}
+
+// Поток рассылки уведомлений: ждёт окно склейки, чтобы серия изменений ушла одним кадром.
+// В сокеты пишет без блокировки: пока у клиента не ушёл прошлый кадр, новые изменения склеиваются в pending
+// (их объём ограничен, дальше — reload), поэтому медленный клиент не задерживает ни остальных, ни сохранение
+void notification_loop(int coalesce_ms) {
+    std::vector<std::shared_ptr<ClientSession>> active; // сеансы с изменениями или недописанным кадром
+    auto queued = []() { return !notify_queue.empty(); };
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(notify_mutex);
+            bool fresh = true;
+            if (active.empty()) notify_cv.wait(lock, queued);
+            else fresh = notify_cv.wait_for(lock, std::chrono::milliseconds(10), queued);
+            if (fresh) {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(coalesce_ms));
+                lock.lock();
+                for (auto& session : notify_queue)
+                    if (std::find(active.begin(), active.end(), session) == active.end()) active.push_back(session);
+                notify_queue.clear();
+            }
+        }
+        auto now = std::chrono::steady_clock::now();
+        for (size_t k = 0; k < active.size();) {
+            if (!deliver_notifications(*active[k], now)) {
+                ++k;
+                continue;
+            }
+            active[k] = std::move(active.back());
+            active.pop_back();
+        }
+    }
+}
+
+// Разбудить поток отмены, чтобы он пересобрал набор сокетов
+void wake_cancel_loop() {
+    uint64_t one = 1;
+    ssize_t written = write(cancel_wakeup, &one, sizeof(one));
+    (void)written; // счётчик eventfd переполниться не может — поток отмены его вычитывает
+}
+
+// Начать запрос: сокет сеанса передаётся потоку отмены, длинный запрос ждёт своей очереди.
+// false — запрос отменили или его срок вышел, пока он ждал (выполнять его не нужно)
+bool begin_request(const std::shared_ptr<ClientSession>& session, bool long_lane) {
+    std::unique_lock<std::mutex> lock(schedule_mutex);
+    session->executing = true;
+    session->watching = true;
+    session->cancel_peeked = 0;
+    watched_sessions.push_back(session);
+    wake_cancel_loop();
+    if (!long_lane) return true;
+    long_queue.push_back(session.get());
+    RequestControl& control = session->control;
+    auto admitted = [&]() { return long_queue.front() == session.get() && long_running < long_slots; };
+    bool ready = schedule_cv.wait_until(lock, control.getDeadline(), [&]() { return admitted() || control.isCancelled(); });
+    if (ready && admitted()) {
+        long_queue.pop_front();
+        ++long_running;
+        session->holds_slot = true;
+        schedule_cv.notify_all(); // при нескольких местах может пройти и следующий
+        return true;
+    }
+    long_queue.erase(std::find(long_queue.begin(), long_queue.end(), session.get()));
+    schedule_cv.notify_all();
+    return false;
+}
+
+// Завершить запрос (до отправки ответа): освободить место длинного запроса и снять сокет с наблюдения.
+// true — поток отмены прочитал команду cancel, и на неё после ответа на запрос нужно ответить отдельно
+bool end_request(const std::shared_ptr<ClientSession>& session) {
+    std::lock_guard<std::mutex> lock(schedule_mutex);
+    if (!session->executing) return false;
+    if (session->holds_slot) --long_running;
+    session->holds_slot = false;
+    session->executing = false;
+    watched_sessions.erase(std::find(watched_sessions.begin(), watched_sessions.end(), session));
+    bool cancel_read = session->cancel_read;
+    session->cancel_read = false;
+    wake_cancel_loop();
+    schedule_cv.notify_all();
+    return cancel_read;
+}
+
+// Поток отмены: смотрит в сокеты сеансов, чьи запросы ждут или выполняются. Если следующий кадр — команда cancel,
+// забирает его и отменяет запрос. Любая другая команда (или конец передачи) остаётся в сокете для сеанса,
+// и до конца запроса сокет больше не смотрится. Набор сокетов пересобирается по сигналу cancel_wakeup из
+// begin_request/end_request
+void cancel_loop() {
+    static const char cancel_frame[] = { 6, 0, 0, 0, 'c', 'a', 'n', 'c', 'e', 'l' }; // длина (int, little-endian) и команда
+    while (true) {
+        std::vector<std::shared_ptr<ClientSession>> targets;
+        bool partial = false;
+        {
+            std::lock_guard<std::mutex> lock(schedule_mutex);
+            for (auto& session : watched_sessions) {
+                if (!session->watching) continue;
+                // Начало кадра cancel уже видели: сокет остаётся готовым к чтению, и poll возвращался бы сразу.
+                // Такой сокет не опрашиваем, пока в нём не станет больше байт
+                int available = 0;
+                if (session->cancel_peeked > 0 && ioctl(session->sock, FIONREAD, &available) == 0 &&
+                    (size_t)available <= session->cancel_peeked) {
+                    partial = true;
+                    continue;
+                }
+                targets.push_back(session);
+            }
+        }
+        std::vector<pollfd> fds;
+        fds.push_back({ cancel_wakeup, POLLIN, 0 });
+        for (auto& session : targets) fds.push_back({ session->sock, POLLIN, 0 });
+        // Остаток кадра cancel poll не покажет (сокет в набор не входит) — в этом редком случае проверяем его периодически
+        if (poll(fds.data(), fds.size(), partial ? 20 : -1) <= 0) continue;
+        if (fds[0].revents & POLLIN) {
+            uint64_t signals;
+            ssize_t got = read(cancel_wakeup, &signals, sizeof(signals));
+            (void)got;
+        }
+        std::lock_guard<std::mutex> lock(schedule_mutex);
+        for (size_t k = 0; k < targets.size(); ++k) {
+            ClientSession& session = *targets[k];
+            if (!(fds[k + 1].revents & (POLLIN | POLLHUP | POLLERR)) || !session.executing || !session.watching) continue;
+            char head[sizeof(cancel_frame)];
+            ssize_t got = recv(session.sock, head, sizeof(head), MSG_PEEK | MSG_DONTWAIT);
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
+            if (got <= 0 || std::memcmp(head, cancel_frame, std::min<size_t>(got, sizeof(cancel_frame))) != 0)
+                session.watching = false; // следующая команда — не cancel (или клиент больше ничего не пришлёт)
+            else if (got == (ssize_t)sizeof(cancel_frame)) {
+                recv(session.sock, head, sizeof(head), MSG_DONTWAIT);
+                session.control.cancel();
+                session.cancel_read = true;
+                session.watching = false;
+            }
+            else session.cancel_peeked = got; // кадр cancel пришёл не целиком — дождёмся остатка
+        }
+        schedule_cv.notify_all(); // отменённый запрос мог ждать очереди
+    }
+}
+
+// Оценка стоимости open: разбор файла, порядка записи на каждые 64 байта (файл из кэша открывается быстрее)
+size_t open_cost(std::string_view path) {
+    struct stat st;
+    return stat(std::string(path).c_str(), &st) == 0 ? (size_t)st.st_size / 64 : 0;
+}
+
+// Строка для JSON: кавычки, обратная косая черта и управляющие символы экранируются
+void append_json_string(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\', out += c;
+        else if ((unsigned char)c < 0x20) {
+            char code[8];
+            std::snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            out += code;
         }
+        else out += c;
     }
+    out += '"';
+}
+
+// Команда для отчёта: не длиннее 256 байт (обрезается по границе символа UTF-8)
+std::string_view report_command(std::string_view command, bool utf8) {
+    if (!utf8) return "(некорректная строка UTF-8)";
+    if (command.size() <= 256) return command;
+    size_t end = 256;
+    while (end > 0 && ((unsigned char)command[end] & 0xC0) == 0x80) --end;
+    return command.substr(0, end);
+}
+
+// Отчёт о трассированном запросе. Пишется при выходе из области видимости — в том числе когда запрос
+// завершён досрочно (быстрый путь print, ошибка отправки): в trace_file (если запрос выбран для трассировки)
+// и в журнал медленных запросов (если он шёл дольше порога)
+struct RequestReport {
+    ClientSession& session;
+    const RequestTrace* trace;           // nullptr — запрос не трассировался
+    bool to_file;                        // писать в trace_file
+    std::string_view command;            // текст команды (UTF-8)
+    size_t cost = 0;                     // оценка планировщика
+    bool long_lane = false;
+    ~RequestReport();
+};
+
+// Событие Chrome trace-event «полный интервал» (ph X): метки времени в микросекундах от запуска сервера
+void append_trace_event(std::string& out, const char* name, int tid, std::chrono::steady_clock::time_point start,
+                        std::chrono::steady_clock::time_point end) {
+    char event[256];
+    std::snprintf(event, sizeof(event), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                  name, (int)getpid(), tid, std::chrono::duration<double, std::micro>(start - trace_epoch).count(),
+                  std::chrono::duration<double, std::micro>(end - start).count());
+    out += event;
+}
+
+RequestReport::~RequestReport() {
+    if (!trace) return;
+    try {
+        auto end = std::chrono::steady_clock::now();
+        double total_ms = std::chrono::duration<double, std::milli>(end - trace->begin()).count();
+        bool slow = slow_query_time.count() && end - trace->begin() >= slow_query_time;
+        if (!to_file && !slow) return;
+        const char* lane = long_lane ? "long" : "short";
+        if (to_file) {
+            std::string events;
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            if (!session.trace_named) {
+                // Имя дорожки: в просмотрщике запросы каждого клиента идут своей строкой
+                char meta[160];
+                std::snprintf(meta, sizeof(meta), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"client %d\"}}",
+                              trace_started ? ",\n" : "", (int)getpid(), session.sock, session.sock);
+                events += meta;
+                trace_started = true;
+                session.trace_named = true;
+            }
+            events += ",\n";
+            append_trace_event(events, "request", session.sock, trace->begin(), end);
+            events += ",\"args\":{\"command\":";
+            append_json_string(events, command);
+            events += ",\"cost\":" + std::to_string(cost) + ",\"lane\":\"" + lane + "\"";
+            if (trace->dropped()) events += ",\"dropped_spans\":" + std::to_string(trace->dropped());
+            events += "}}";
+            for (const RequestTrace::Span& span : trace->spans()) {
+                events += ",\n";
+                append_trace_event(events, span.name, session.sock, span.start, span.end);
+                events += '}';
+            }
+            trace_out << events;
+            trace_out.flush();
+        }
+        if (slow) {
+            // Разбивка по этапам: время этапов с одним именем суммируется, порядок — по первому появлению
+            std::vector<std::pair<const char*, double>> totals;
+            for (const RequestTrace::Span& span : trace->spans()) {
+                auto it = std::find_if(totals.begin(), totals.end(), [&](const auto& t) { return std::strcmp(t.first, span.name) == 0; });
+                if (it == totals.end()) it = totals.insert(totals.end(), { span.name, 0.0 });
+                it->second += std::chrono::duration<double, std::milli>(span.end - span.start).count();
+            }
+            char head[160], when[32];
+            std::time_t now = std::time(nullptr);
+            std::tm local;
+            std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&now, &local));
+            std::snprintf(head, sizeof(head), "%s %.3f мс клиент %d стоимость %zu (%s): ", when, total_ms, session.sock, cost, lane);
+            std::string line = head;
+            line += command;
+            line += " |";
+            for (const auto& [name, ms] : totals) {
+                char part[96];
+                std::snprintf(part, sizeof(part), " %s=%.3f", name, ms);
+                line += part;
+            }
+            line += '\n';
+            std::lock_guard<std::mutex> lock(trace_mutex);
+            if (slow_out.is_open()) {
+                slow_out << line;
+                slow_out.flush();
+            }
+            else std::wcerr << L"Медленный запрос: " << utf8_to_utf16(line);
+        }
+    }
+    catch (...) {} // отчёт не должен обрывать сеанс
+}
+
+// Общая память для клиента на Unix-сокете: memfd с кольцевым буфером, дескриптор уходит вместе с ответом (SCM_RIGHTS)
+bool enable_shm(ClientSession& session, size_t capacity) {
+    sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    std::string text;
+    int fd = -1;
+    if (getsockname(session.sock, (sockaddr*)&addr, &addrLen) != 0 || addr.ss_family != AF_UNIX)
+        text = "Ошибка: общая память доступна только через Unix-сокет\n";
+    else if (capacity < 4096 || capacity > shm_max_size)
+        text = "Ошибка: размер буфера от 4096 до " + std::to_string(shm_max_size) + " байт\n";
+    else if (session.ring)
+        text = "Общая память уже включена (" + std::to_string(session.ring_capacity) + " байт)\n";
+    else {
+        size_t bytes = sizeof(ShmRing) + capacity;
+        fd = memfd_create("subd-ring", MFD_CLOEXEC);
+        void* map = fd < 0 || ftruncate(fd, bytes) != 0 ? MAP_FAILED : mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            if (fd >= 0) close(fd);
+            fd = -1;
+            text = "Ошибка: не удалось создать общую память\n";
+        }
+        else {
+            session.ring = new (map) ShmRing{ {0}, {0}, capacity };
+            session.ring_bytes = bytes;
+            session.ring_capacity = bytes - sizeof(ShmRing);
+            session.ring_head = 0;
+            text = "Общая память включена (" + std::to_string(capacity) + " байт)\n";
+        }
+    }
+    int length = text.size();
+    text.insert(0, reinterpret_cast<const char*>(&length), sizeof(int));
+    iovec iov{ text.data(), text.size() };
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (fd >= 0) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    ssize_t sent = sendmsg(session.sock, &msg, MSG_NOSIGNAL);
+    if (fd >= 0) close(fd); // отображение остаётся, дескриптор больше не нужен
+    return sent > 0 && send_all(session.sock, text.data() + sent, text.size() - sent);
+}
+
+// Ответ через общую память: кадр -3 и общая длина, затем куски в буфере и их длины в сокете.
+// Если клиент не освобождает место (завис или отключился), через 10 секунд сдаёмся; tail, который не может
+// быть правдой (больше записанного или отстаёт больше чем на буфер), — ошибка протокола, сеанс закрывается
+bool send_ring_response(ClientSession& session, std::string_view payload) {
+    ShmRing* ring = session.ring;
+    const size_t capacity = session.ring_capacity;
+    int header[2] = { -3, (int)payload.size() };
+    if (!send_all(session.sock, reinterpret_cast<const char*>(header), sizeof(header))) return false;
+    const size_t chunk = capacity / 2; // пока клиент читает один кусок, сервер пишет следующий
+    for (size_t done = 0; done < payload.size();) {
+        size_t length = std::min(chunk, payload.size() - done);
+        uint64_t head = session.ring_head;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (true) {
+            uint64_t tail = ring->tail.load(std::memory_order_acquire);
+            if (tail > head || head - tail > capacity) return false;
+            if (capacity - (head - tail) >= length) break;
+            if (std::chrono::steady_clock::now() > deadline) return false;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        size_t pos = head % capacity;
+        size_t first = std::min(length, capacity - pos);
+        std::memcpy(ring->data() + pos, payload.data() + done, first);
+        std::memcpy(ring->data(), payload.data() + done + first, length - first);
+        session.ring_head = head + length;
+        ring->head.store(session.ring_head, std::memory_order_release);
+        int chunkLength = (int)length;
+        if (!send_all(session.sock, reinterpret_cast<const char*>(&chunkLength), sizeof(int))) return false;
+        done += length;
+    }
+    return true;
+}
+
+// Отправка ответа прямо из файла: заголовок с длиной, затем байты файла через sendfile (без копирования через user space)
+bool send_file_response(int clientSocket, int fd, off_t offset, size_t length) {
+    int respLength = (int)length;
+    if (send(clientSocket, &respLength, sizeof(int), length ? MSG_MORE : 0) != sizeof(int))
+        return false;
+    while (length > 0) {
+        ssize_t sent = sendfile(clientSocket, fd, &offset, length);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        length -= sent;
+    }
+    return true;
 }
 
 void handle_client(int clientSocket) {
     std::wstring current_db_file;
     std::shared_ptr<Database> db_ptr;
+    auto session = std::make_shared<ClientSession>();
+    session->sock = clientSocket;
     {
         std::lock_guard<std::mutex> lock(clients_mutex);
-        client_sockets.insert(clientSocket);
+        sessions[clientSocket] = session;
     }
+    // Временные массивы запроса берутся из арены сеанса и освобождаются разом после отправки ответа;
+    // буфер ответа (4 байта длины + текст) тоже переходит от запроса к запросу без новых выделений
+    RequestArena arena;
+    std::string response;
+    RequestTrace trace; // этапы текущего запроса (память под них тоже переходит от запроса к запросу)
     while (true) {
+        RequestArena::Scope requestMemory(arena);
         int msgLength;
         ssize_t bytesRead = recv(clientSocket, &msgLength, sizeof(int), 0);
         if (bytesRead <= 0) {
             std::wcerr << L"\033[1;31mКлиент отключился или произошла ошибка\033[0m\n";
             break;
         }
+        auto arrived = std::chrono::steady_clock::now(); // запрос отсчитывается с заголовка, а не с ожидания его
         if (msgLength == -1) {
             // Это уведомление от сервера, клиенту не нужно отвечать
             continue;
@@ -94,74 +637,210 @@ void handle_client(int clientSocket) {
         try {
             if (msgLength <= 0) {
                 std::wcerr << L"\033[1;31mНекорректная длина сообщения\033[0m\n";
-                close(clientSocket);
-                return;
+                break;
             }
-            std::vector<char> buffer(msgLength + 1);
+            std::pmr::vector<char> buffer(msgLength + 1, RequestArena::current());
             int totalReceived = 0;
             while (totalReceived != msgLength) {
                 bytesRead = recv(clientSocket, buffer.data() + totalReceived, msgLength - totalReceived, 0);
                 if (bytesRead <= 0) {
                     std::wcerr << L"\033[1;31mОшибка получения ответа\033[0m\n";
-                    close(clientSocket);
-                    return;
+                    break;
                 }
                 totalReceived += bytesRead;
             }
+            if (totalReceived != msgLength) break;
             buffer[msgLength] = '\0';
+            auto received = std::chrono::steady_clock::now();
 
-            std::wstring wmessage = utf8_to_utf16(buffer.data());
-            std::wcout << L"Получено от клиента: " << wmessage << std::endl;
+            // Команда разбирается прямо в байтах UTF-8; в UTF-16 переводится только строка журнала
+            std::string_view command(buffer.data(), msgLength);
+            std::string_view verb = command.substr(0, command.find(' '));
+            std::string_view args = command.substr(std::min(command.size(), verb.size() + 1));
+            // Трассировка: выбранные запросы — в trace_file, а при включённом журнале медленных этапы нужны у всех
+            bool sampled = trace_sample && trace_counter.fetch_add(1, std::memory_order_relaxed) % trace_sample == 0;
+            bool to_file = trace_out.is_open() && (session->tracing || sampled);
+            bool traced = to_file || slow_query_time.count();
+            if (traced) {
+                trace.start(arrived);
+                trace.add("recv", arrived, received);
+            }
+            RequestTrace::Scope requestTrace(traced ? &trace : nullptr);
+            bool utf8 = true;
+            std::wstring logged;
+            try {
+                TraceSpan span("utf8_to_utf16");
+                logged = utf8_to_utf16(command);
+            }
+            catch (const std::runtime_error&) {
+                utf8 = false;
+                logged = L"(некорректная строка UTF-8)";
+            }
+            RequestReport report{ *session, traced ? &trace : nullptr, to_file, report_command(command, utf8) };
+            std::wcout << L"Получено от клиента: " << logged << std::endl;
+            // Быстрый путь: print всех записей без фильтра отдаём прямо из файла, без форматирования строк.
+            // Запрос всё равно проходит планировщик (оценка, очередь длинных, срок и отмена) — ниже, как и остальные
+            int raw_fd = -1;
+            off_t raw_offset = 0;
+            size_t raw_length = 0;
+            if (db_ptr && verb == "print") {
+                raw_fd = db_ptr->openRawPrint(args, raw_offset, raw_length);
+                if (raw_fd >= 0 && raw_length > INT_MAX) {
+                    close(raw_fd);
+                    raw_fd = -1;
+                }
+            }
+            // Общая память для больших ответов: дескриптор передаётся вместе с ответом, поэтому отвечаем здесь же
+            if (verb == "shm") {
+                size_t capacity = 0;
+                std::from_chars(args.data(), args.data() + args.size(), capacity);
+                std::lock_guard<std::mutex> lock(session->send_mutex);
+                if (!flush_outbox(*session) || !enable_shm(*session, capacity)) {
+                    std::wcerr << L"\033[1;31mОшибка отправки ответа\033[0m\n";
+                    break;
+                }
+                continue;
+            }
+            // Планировщик: по оценке стоимости — короткая полоса или очередь длинных запросов; cancel сюда попадает,
+            // только если запроса в работе нет (иначе его забрал поток отмены)
+            bool cancel_command = command == "cancel";
+            size_t cost = 0;
+            if (utf8 && !cancel_command) {
+                TraceSpan span("estimate");
+                cost = verb == "open" ? open_cost(args) : db_ptr ? db_ptr->estimateCost(command) : 0;
+            }
+            bool long_lane = cost > short_cost;
+            report.cost = cost;
+            report.long_lane = long_lane;
+            session->control.start(request_timeout.count() ? received + request_timeout : RequestControl::Clock::time_point::max());
+            bool admitted = cancel_command;
+            if (!admitted) {
+                TraceSpan span("queue");
+                admitted = begin_request(session, long_lane);
+            }
+            bool interrupted = !admitted;
             std::wstring captured_output;
+            response.assign(sizeof(int), '\0'); // место под длину, дальше строки print (уже в UTF-8)
             {
+                TraceSpan span("execute");
                 WcoutRedirect redirect;
-                // Определяем имя файла БД при первой команде open
-                if (wmessage.substr(0, 4) == L"open") {
-                    std::wstring filename = wmessage.substr(5); // open <filename>
-                    std::lock_guard<std::mutex> lock(db_map_mutex);
-                    current_db_file = filename;
-                    // Создаём новый экземпляр Database для клиента
-                    db_ptr = std::make_shared<Database>();
-                    db_ptr->selectDB(filename);
-                    // Регистрируем колбэк для уведомлений
-                    db_ptr->notifyOnChange([filename, clientSocket]() {
-                        // Уведомляем всех клиентов с этим файлом, кроме инициатора
-                        std::lock_guard<std::mutex> lock2(clients_mutex);
-                        auto it = file_clients_map.find(filename);
-                        if (it != file_clients_map.end()) {
-                            for (int sock : it->second) {
-                                if (sock == clientSocket) continue;
-                                int update_code = -1;
-                                send(sock, &update_code, sizeof(int), 0);
-                            }
+                RequestControl::Scope requestControl(session->control);
+                try {
+                    if (!utf8) {
+                        captured_output = L"Ошибка: некорректная строка UTF-8\n";
+                    }
+                    else if (!admitted) {
+                        throw RequestInterrupted(!session->control.isCancelled());
+                    }
+                    else if (cancel_command) {
+                        captured_output = L"Нет выполняющегося запроса для отмены\n";
+                    }
+                    // Подписка на изменения: вместо сигнала -1 клиент получает версию и изменённые записи
+                    else if (command == "subscribe" || command == "unsubscribe") {
+                        std::lock_guard<std::mutex> lock(notify_mutex);
+                        session->subscribed = command == "subscribe";
+                        captured_output = session->subscribed ? L"Подписка на изменения включена\n" : L"Подписка на изменения отключена\n";
+                    }
+                    // Трассировка всех запросов сеанса (следующих: этот уже выбран или нет)
+                    else if (command == "trace on" || command == "trace off") {
+                        session->tracing = command == "trace on";
+                        if (!trace_out.is_open()) captured_output = L"Трассировка не настроена: в конфигурации сервера не задан trace_file\n";
+                        else captured_output = session->tracing ? L"Трассировка запросов включена\n" : L"Трассировка запросов отключена\n";
+                    }
+                    // Определяем имя файла БД при первой команде open
+                    else if (command.substr(0, 4) == "open") {
+                        std::wstring filename = utf8_to_utf16(command.substr(std::min<size_t>(command.size(), 5))); // open <filename>
+                        std::lock_guard<std::mutex> lock(db_map_mutex);
+                        current_db_file = filename;
+                        // Создаём новый экземпляр Database для клиента
+                        db_ptr = std::make_shared<Database>();
+                        db_ptr->selectDB(filename);
+                        // Регистрируем колбэк для уведомлений
+                        db_ptr->notifyOnChange([filename, initiator = std::weak_ptr<ClientSession>(session)](size_t, const Database::ChangeSet& changes) {
+                            // Уведомляем всех клиентов с этим файлом, кроме инициатора (если он ещё подключён)
+                            notify_clients_db_update(filename, initiator.lock().get(), changes);
+                        });
+                        db_instances_map[filename].push_back(db_ptr);
+                        // Зарегистрировать клиента для этого файла
+                        {
+                            std::lock_guard<std::mutex> lock2(clients_mutex);
+                            file_clients_map[filename].insert(clientSocket);
                         }
-                    });
-                    db_instances_map[filename].push_back(db_ptr);
-                    // Зарегистрировать клиента для этого файла
-                    {
-                        std::lock_guard<std::mutex> lock2(clients_mutex);
-                        file_clients_map[filename].insert(clientSocket);
+                        captured_output = redirect.getOutput();
                     }
-                    captured_output = redirect.getOutput();
+                    else if (command == "memory") {
+                        Database::printMemory();
+                        captured_output = redirect.getOutput();
+                    }
+                    else if (!db_ptr) {
+                        // Если не был выполнен open, игнорируем команду
+                        captured_output = L"Сначала выполните команду open <файл>";
+                    } else if (raw_fd >= 0) {
+                        // Строки уходят из файла при отправке; пока запрос ждал очереди, его могли отменить
+                        RequestControl::checkpoint();
+                    } else if (verb == "print") {
+                        // Строки записей форматируются сразу в UTF-8, перекодируются только сообщения перед ними
+                        db_ptr->printInto(args, response);
+                        captured_output = redirect.getOutput();
+                    } else {
+                        db_ptr->parseCommand(command);
+                        captured_output = redirect.getOutput();
+                    }
+                }
+                catch (const RequestInterrupted& e) {
+                    // Прерванный запрос ничего не изменил: недописанный вывод отбрасываем
+                    interrupted = true;
+                    response.resize(sizeof(int));
+                    captured_output = e.expired ? L"Ошибка: срок выполнения запроса истёк (request_timeout_ms = " +
+                                                  std::to_wstring(request_timeout.count()) + L")\n"
+                                                : L"Ошибка: запрос отменён\n";
+                }
+            }
+            // Ответ из файла: место длинного запроса держится до конца отправки
+            bool raw = raw_fd >= 0 && !interrupted;
+            bool cancel_read = raw ? false : end_request(session);
+            if (!captured_output.empty()) {
+                TraceSpan span("utf16_to_utf8");
+                response.insert(sizeof(int), utf16_to_utf8(captured_output));
+            }
+            std::string_view payload = std::string_view(response).substr(sizeof(int));
+            bool ringFailed = false, rawFailed = false;
+            {
+                TraceSpan span("send");
+                std::lock_guard<std::mutex> lock(session->send_mutex);
+                flush_outbox(*session);
+                if (raw) {
+                    rawFailed = !send_file_response(clientSocket, raw_fd, raw_offset, raw_length);
+                    cancel_read = end_request(session);
+                }
+                // Большой ответ локальному клиенту — через общую память, минуя буферы сокета
+                else if (session->ring && payload.size() >= shm_threshold && payload.size() <= INT_MAX)
+                    ringFailed = !send_ring_response(*session, payload);
+                else {
+                    int respLength = payload.size();
+                    std::memcpy(&response[0], &respLength, sizeof(int));
+                    send_all(clientSocket, response.data(), response.size());
                 }
-                else if (!db_ptr) {
-                    // Если не был выполнен open, игнорируем команду
-                    captured_output = L"Сначала выполните команду open <файл>";
-                } else {
-                    db_ptr->parseCommand(wmessage);
-                    captured_output = redirect.getOutput();
+                // Ответ на cancel, который прочитал поток отмены, — следом за ответом на сам запрос
+                if (cancel_read) {
+                    std::string reply = utf16_to_utf8(interrupted ? L"Запрос отменён\n" : L"Отменять нечего: запрос уже выполнен\n");
+                    int replyLength = reply.size();
+                    reply.insert(0, reinterpret_cast<const char*>(&replyLength), sizeof(int));
+                    send_all(clientSocket, reply.data(), reply.size());
                 }
             }
-            std::string message = utf16_to_utf8(captured_output);
-            int respLength = message.size();
-            send(clientSocket, &respLength, sizeof(int), 0);
-            send(clientSocket, message.c_str(), respLength, 0);
+            if (raw_fd >= 0) close(raw_fd);
+            if (response.capacity() > response_keep_bytes) std::string().swap(response);
+            if (ringFailed || rawFailed) {
+                std::wcerr << L"\033[1;31mОшибка отправки ответа\033[0m\n";
+                break;
+            }
         } catch (const std::bad_alloc&) {
             std::wcerr << L"\033[1;31mОшибка выделения памяти (bad_alloc)\033[0m\n";
-            close(clientSocket);
-            return;
+            break;
         }
     }
+    end_request(session); // запрос мог оборваться исключением
     // Удаляем клиента из file_clients_map и db_instances_map
     if (!current_db_file.empty()) {
         std::lock_guard<std::mutex> lock(clients_mutex);
@@ -178,9 +857,16 @@ void handle_client(int clientSocket) {
     }
     {
         std::lock_guard<std::mutex> lock(clients_mutex);
-        client_sockets.erase(clientSocket);
+        sessions.erase(clientSocket);
+    }
+    // Поток уведомлений мог ещё держать сеанс: после closed он в этот номер сокета не пишет
+    {
+        std::lock_guard<std::mutex> lock(session->send_mutex);
+        session->closed = true;
+        close(clientSocket);
+        if (session->ring) munmap(session->ring, session->ring_bytes);
+        session->ring = nullptr;
     }
-    close(clientSocket);
 }
 
 int main() {
@@ -189,6 +875,63 @@ int main() {
     std::map<std::string, std::string> config = read_config("server_config.ini");
     int port = std::stoi(config["port"]);
     int max_clients = std::stoi(config["max_clients"]);
+    // Окно склейки уведомлений об изменениях (мс): серия сохранений уходит клиентам одним кадром
+    int notify_coalesce_ms = config.count("notify_coalesce_ms") ? std::stoi(config["notify_coalesce_ms"]) : 50;
+    // Клиент, который столько не читает уведомления (мс), отключается
+    if (config.count("notify_drop_ms")) notify_drop_timeout = std::chrono::milliseconds(std::stoul(config["notify_drop_ms"]));
+    std::thread(notification_loop, notify_coalesce_ms).detach();
+    // Планировщик: порог короткого запроса (в записях по оценке), число одновременных длинных и срок запроса (мс, 0 — без срока)
+    if (config.count("short_cost")) short_cost = std::stoul(config["short_cost"]);
+    if (config.count("long_slots")) long_slots = std::max<size_t>(1, std::stoul(config["long_slots"]));
+    if (config.count("request_timeout_ms")) request_timeout = std::chrono::milliseconds(std::stoul(config["request_timeout_ms"]));
+    cancel_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cancel_wakeup < 0) {
+        std::wcerr << L"\033[1;31mОшибка создания eventfd для потока отмены\033[0m\n";
+        return 1;
+    }
+    std::thread(cancel_loop).detach();
+    // Трассировка: файл событий Chrome trace-event, выборка (каждый N-й запрос), порог и файл журнала медленных запросов
+    if (config.count("trace_file") && !config["trace_file"].empty()) {
+        trace_out.open(config["trace_file"]);
+        if (!trace_out) std::wcerr << L"\033[1;31mНе удалось открыть trace_file\033[0m\n";
+        else trace_out << "[\n"; // массив не закрывается: просмотрщики принимают оборванный JSON-массив событий
+    }
+    if (config.count("trace_sample")) trace_sample = std::stoul(config["trace_sample"]);
+    if (config.count("slow_query_ms")) slow_query_time = std::chrono::milliseconds(std::stoul(config["slow_query_ms"]));
+    if (config.count("slow_query_log") && !config["slow_query_log"].empty()) {
+        slow_out.open(config["slow_query_log"], std::ios::app);
+        if (!slow_out) std::wcerr << L"\033[1;31mНе удалось открыть slow_query_log\033[0m\n";
+    }
+    // Параллельная фильтрация на больших выборках: порог в записях и размер пула (0 - по числу ядер)
+    Database::setParallelism(config.count("parallel_threshold") ? std::stoul(config["parallel_threshold"]) : 100000,
+                             config.count("parallel_threads") ? std::stoul(config["parallel_threads"]) : 0);
+    // Индексы, которые строятся сразу при open; остальные — в фоне (background_indexes = 1) или при первом обращении
+    Database::setIndexing(config.count("eager_indexes") ? config["eager_indexes"] : "all",
+                          !config.count("background_indexes") || config["background_indexes"] != "0");
+    // Кэш загруженных файлов: повторный open того же файла без разбора, простаивающие файлы вытесняются сверх бюджета
+    Database::setCacheBudget((config.count("cache_budget_mb") ? std::stoul(config["cache_budget_mb"]) : 256) << 20);
+    // Слежение за открытыми файлами: запись другим процессом применяется к экземплярам и рассылается клиентам
+    if (!config.count("watch_files") || config["watch_files"] != "0") {
+        Database::onExternalChange([](const std::string& path, const Database::ChangeSet& changes) {
+            // Клиенты открывают файл под разными именами — рассылаем по всем, что ведут к нему
+            std::vector<std::wstring> names;
+            {
+                std::lock_guard<std::mutex> lock(clients_mutex);
+                for (const auto& [name, socks] : file_clients_map)
+                    if (Database::fileKey(utf16_to_utf8(name)) == path) names.push_back(name);
+            }
+            for (const auto& name : names) {
+                std::wcerr << L"Файл " << name << L" изменён извне\n";
+                notify_clients_db_update(name, nullptr, changes);
+            }
+        });
+        Database::setWatching(true);
+    }
+
+    // Локальные клиенты (импорт, GUI на той же машине): Unix-сокет и общая память для больших ответов
+    std::string unix_path = config.count("unix_socket") ? config["unix_socket"] : "";
+    if (config.count("shm_threshold")) shm_threshold = std::stoul(config["shm_threshold"]);
+    if (config.count("shm_max_size")) shm_max_size = std::stoul(config["shm_max_size"]);
 
     int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if (serverSocket < 0) {
@@ -220,17 +963,43 @@ int main() {
         return 1;
     }
 
+    int unixSocket = -1;
+    if (!unix_path.empty()) {
+        struct sockaddr_un unixAddr;
+        std::memset(&unixAddr, 0, sizeof(unixAddr));
+        unixAddr.sun_family = AF_UNIX;
+        if (unix_path.size() >= sizeof(unixAddr.sun_path)) {
+            std::wcerr << L"\033[1;31mСлишком длинный путь unix_socket\033[0m\n";
+            return 1;
+        }
+        std::strcpy(unixAddr.sun_path, unix_path.c_str());
+        // Сокет от прошлого запуска; обычный файл по этому пути не трогаем — bind ниже сообщит об ошибке
+        struct stat existing;
+        if (lstat(unix_path.c_str(), &existing) == 0 && S_ISSOCK(existing.st_mode)) unlink(unix_path.c_str());
+        unixSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (unixSocket < 0 || bind(unixSocket, (struct sockaddr*)&unixAddr, sizeof(unixAddr)) < 0 || listen(unixSocket, max_clients) < 0) {
+            std::wcerr << L"\033[1;31mОшибка создания Unix-сокета\033[0m\n";
+            return 1;
+        }
+    }
+
     std::wcout << L"Сервер запущен на порту " << port << L". Ожидание подключений...\n";
+    if (unixSocket >= 0) std::wcout << L"Локальные подключения: " << utf8_to_utf16(unix_path) << L"\n";
 
     while (true) {
-        struct sockaddr_in clientAddr;
+        // Ждём подключения сразу на TCP и Unix-сокете
+        struct pollfd listeners[2] = { { serverSocket, POLLIN, 0 }, { unixSocket, POLLIN, 0 } };
+        if (poll(listeners, unixSocket >= 0 ? 2 : 1, -1) < 0) continue;
+        bool local = !(listeners[0].revents & POLLIN);
+        struct sockaddr_storage clientAddr;
         socklen_t clientLen = sizeof(clientAddr);
-        int clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
+        int clientSocket = accept(local ? unixSocket : serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
         if (clientSocket < 0) {
             std::wcerr << L"\033[1;31mОшибка принятия подключения\033[0m\n";
             continue;
         }
-        std::wcout << L"Новый клиент подключен: " << utf8_to_utf16(inet_ntoa(clientAddr.sin_addr)) << std::endl;
+        if (local) std::wcout << L"Новый клиент подключен: " << utf8_to_utf16(unix_path) << std::endl;
+        else std::wcout << L"Новый клиент подключен: " << utf8_to_utf16(inet_ntoa(((struct sockaddr_in*)&clientAddr)->sin_addr)) << std::endl;
         std::thread([clientSocket]() { handle_client(clientSocket); }).detach();
         std::wcout << L"Ожидание новых подключений...\n";
     }
@@ -2,37 +2,563 @@
 #include <cwchar>
 #include <regex>
 #include <typeinfo>
+#include <cstdint>
+#include <cmath>
+#include <cstdio>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <iomanip>
+#include <charconv>
+#include <unordered_map>
+#include <optional>
+#include <sys/inotify.h>
 
 // -------------------------------------------------- Функции перевода строк из разных кодировок --------------------------------------------------
+// Дописать строку в UTF-8 (wchar_t — код символа), без iconv и промежуточных строк
+static void appendUtf8(std::string& out, const wchar_t* text, size_t length) {
+    size_t at = out.size();
+    out.resize(at + length * 4);
+    char* p = &out[at];
+    for (size_t i = 0; i < length; ++i) {
+        uint32_t c = (uint32_t)text[i];
+        if (c < 0x80) *p++ = (char)c;
+        else if (c < 0x800) {
+            *p++ = (char)(0xC0 | (c >> 6));
+            *p++ = (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000) {
+            *p++ = (char)(0xE0 | (c >> 12));
+            *p++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *p++ = (char)(0x80 | (c & 0x3F));
+        }
+        else {
+            *p++ = (char)(0xF0 | (c >> 18));
+            *p++ = (char)(0x80 | ((c >> 12) & 0x3F));
+            *p++ = (char)(0x80 | ((c >> 6) & 0x3F));
+            *p++ = (char)(0x80 | (c & 0x3F));
+        }
+    }
+    out.resize(p - out.data());
+}
+// Дописать строку UTF-8 кодами символов (wchar_t), без локали и промежуточных строк (false — некорректный UTF-8, out не меняется)
+static bool appendWide(std::wstring& out, std::string_view text) {
+    size_t at = out.size();
+    out.resize(at + text.size());
+    wchar_t* p = &out[at];
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = (unsigned char)text[i++];
+        uint32_t code = c;
+        size_t extra = 0;
+        if ((c & 0xE0) == 0xC0) code = c & 0x1F, extra = 1;
+        else if ((c & 0xF0) == 0xE0) code = c & 0x0F, extra = 2;
+        else if ((c & 0xF8) == 0xF0) code = c & 0x07, extra = 3;
+        else if (c >= 0x80) extra = text.size(); // байт продолжения или недопустимый байт в начале символа
+        if (extra > text.size() - i) {
+            out.resize(at);
+            return false;
+        }
+        for (; extra; --extra) {
+            unsigned char next = (unsigned char)text[i++];
+            if ((next & 0xC0) != 0x80) {
+                out.resize(at);
+                return false;
+            }
+            code = code << 6 | (next & 0x3F);
+        }
+        *p++ = (wchar_t)code;
+    }
+    out.resize(p - out.data());
+    return true;
+}
 // Конвертация UTF-8 (файл) → UTF-16 (в памяти)
-std::wstring utf8_to_utf16(const std::string& input) {
-
-    // Определим размер буфера для результата
-    size_t size = std::mbstowcs(nullptr, input.c_str(), 0);
-    if (size == static_cast<size_t>(-1)) {
+std::wstring utf8_to_utf16(std::string_view input) {
+    std::wstring result;
+    if (!appendWide(result, input)) {
         throw std::runtime_error("Conversion to wide string failed.");
     }
-
-    std::wstring result(size, L'\0');
-    std::mbstowcs(&result[0], input.c_str(), size);
     return result;
 }
 
 // Конвертация UTF-16 → UTF-8 (для имени файла)
 std::string utf16_to_utf8(const std::wstring& input) {
+    std::string result;
+    appendUtf8(result, input.data(), input.size());
+    return result;
+}
 
-    // Определим размер необходимого буфера
-    size_t size = std::wcstombs(nullptr, input.c_str(), 0);
-    if (size == static_cast<size_t>(-1)) {
-        throw std::runtime_error("Conversion to narrow string failed.");
+// -------------------------------------------------- Конфигурация --------------------------------------------------
+// Парсинг конфига
+std::map<std::string, std::string> read_config(const std::string& filename) {
+    std::ifstream file(filename);
+    std::map<std::string, std::string> config;
+    std::string line;
+    
+    while (std::getline(file, line)) {
+        size_t delim_pos = line.find('=');
+        if (delim_pos != std::string::npos) {
+            std::string key = line.substr(0, line.find_last_not_of(" \t", delim_pos - 1) + 1);
+            std::string value = line.substr(delim_pos + 1);
+            value.erase(0, value.find_first_not_of(" \t"));
+            config[key] = value;
+        }
     }
+    
+    return config;
+}
 
-    std::string result(size, '\0');
-    std::wcstombs(&result[0], input.c_str(), size);
-    return result;
+// -------------------------------------------------- Разбор команд --------------------------------------------------
+static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; }
+static bool isFieldChar(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_'; }
+// Число из всей строки целиком ("101", "4.5"); пробелы, знак + и хвост после числа — ошибка
+template <typename T>
+static bool parseNumber(std::string_view text, T& value) {
+    auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+    return error == std::errc() && end == text.data() + text.size();
+}
+// Ошибка в команде: описание и фрагмент, на котором остановился разбор
+static void commandError(const wchar_t* error, std::string_view at) {
+    std::wcout << L"Ошибка: " << error;
+    std::wstring fragment;
+    if (!at.empty() && appendWide(fragment, at)) std::wcout << L": " << fragment;
+    std::wcout << L"\n";
+}
+std::string_view next_word(std::string_view& rest) {
+    size_t start = 0;
+    while (start < rest.size() && isSpace(rest[start])) ++start;
+    size_t end = start;
+    while (end < rest.size() && !isSpace(rest[end])) ++end;
+    std::string_view word = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return word;
+}
+// Слово — ключевое слово keyword (латиница, в любом регистре)
+static bool isKeyword(std::string_view word, std::string_view keyword) {
+    if (word.size() != keyword.size()) return false;
+    for (size_t i = 0; i < word.size(); ++i)
+        if ((word[i] | 0x20) != keyword[i]) return false;
+    return true;
+}
+CriteriaTokens lex_criteria(std::string_view command) {
+    CriteriaTokens tokens;
+    size_t i = 0;
+    // Ошибка с фрагментом команды от from до конца слова
+    auto fail = [&](const wchar_t* error, size_t from) {
+        size_t end = i;
+        while (end < command.size() && !isSpace(command[end])) ++end;
+        tokens.error = error;
+        tokens.errorAt = command.substr(from, end - from);
+        return tokens;
+    };
+    bool orBefore = false, negate = false;
+    size_t keywordStart = 0; // последнее or/not, ещё не получившее условия
+    for (;;) {
+        while (i < command.size() && isSpace(command[i])) ++i;
+        if (i == command.size()) {
+            if (orBefore || negate) return fail(L"после or/not ожидалось условие", keywordStart);
+            return tokens;
+        }
+        size_t start = i;
+        while (i < command.size() && isFieldChar(command[i])) ++i;
+        std::string_view word = command.substr(start, i - start);
+        if (i == command.size() || isSpace(command[i])) { // слово без = — связка
+            if (isKeyword(word, "or")) {
+                if (tokens.count == 0 || orBefore || negate) return fail(L"перед or нет условия", start);
+                orBefore = true;
+                keywordStart = start;
+                continue;
+            }
+            if (isKeyword(word, "where")) { // дальше — условия update/remove, их разбирает отдельный вызов
+                if (orBefore || negate) return fail(L"после or/not ожидалось условие", keywordStart);
+                tokens.where = true;
+                tokens.condition = command.substr(i);
+                return tokens;
+            }
+            if (isKeyword(word, "not") && !negate) {
+                negate = true;
+                keywordStart = start;
+                continue;
+            }
+        }
+        if (i == command.size() || command[i] != '=')
+            return fail(L"ожидалось поле=значение", start);
+        if (i == start) return fail(L"нет имени поля перед =", start);
+        ++i;
+        for (bool listItem = false;; listItem = true) { // значения списка через запятую
+            if (tokens.count == CriteriaTokens::capacity) return fail(L"слишком много критериев", start);
+            CriterionToken& token = tokens.items[tokens.count];
+            token.field = word;
+            token.negate = negate;
+            token.orBefore = orBefore && !listItem;
+            token.listItem = listItem;
+            size_t valueStart = i;
+            if (i < command.size() && command[i] == '"') { // значение в кавычках: до закрывающей кавычки, пробелы и запятые внутри — часть значения
+                size_t close = command.find('"', i + 1);
+                if (close == std::string_view::npos) return fail(L"незакрытая кавычка", start);
+                token.value = command.substr(i + 1, close - i - 1);
+                i = close + 1;
+                if (i < command.size() && !isSpace(command[i]) && command[i] != ',')
+                    return fail(L"после кавычки ожидался пробел или запятая", start);
+            }
+            else {
+                while (i < command.size() && !isSpace(command[i]) && command[i] != ',') ++i;
+                token.value = command.substr(valueStart, i - valueStart);
+                if (token.value.empty()) return fail(L"пустое значение (пустая строка — \"\")", start);
+            }
+            ++tokens.count;
+            if (i == command.size() || command[i] != ',') break;
+            ++i;
+        }
+        orBefore = negate = false;
+    }
+}
+
+// -------------------------------------------------- Пул потоков --------------------------------------------------
+// Одна параллельная операция: задачи разбираются атомарным счётчиком (morsel-driven)
+struct ThreadPool::Job {
+    size_t count = 0;
+    const std::function<void(size_t)>* fn = nullptr; // живёт в вызывающем потоке до завершения всех задач
+    std::atomic<size_t> next{ 0 };
+    size_t finished = 0;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    void run() {
+        for (size_t i; (i = next.fetch_add(1)) < count;) {
+            std::exception_ptr err;
+            try { (*fn)(i); }
+            catch (...) { err = std::current_exception(); }
+            std::lock_guard<std::mutex> lock(mutex);
+            if (err && !error) error = err;
+            if (++finished == count) cv.notify_all();
+        }
+    }
+};
+
+size_t ThreadPool::configuredThreads = 0;
+
+ThreadPool::ThreadPool(size_t threads) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 1; i < threads; ++i)
+        workers.emplace_back([this]() { workerLoop(); });
+}
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (stopping) return;
+            job = queue.front();
+            queue.pop_front();
+        }
+        job->run();
+    }
+}
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& fn) {
+    if (workers.empty() || count <= 1) {
+        for (size_t i = 0; i < count; ++i) fn(i);
+        return;
+    }
+    auto job = std::make_shared<Job>();
+    job->count = count;
+    job->fn = &fn;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = 0; i < std::min(workers.size(), count - 1); ++i)
+            queue.push_back(job);
+    }
+    cv.notify_all();
+    job->run(); // вызывающий поток тоже работает, поэтому вложенные parallelFor не блокируются
+    std::unique_lock<std::mutex> lock(job->mutex);
+    job->cv.wait(lock, [&]() { return job->finished == job->count; });
+    if (job->error) std::rethrow_exception(job->error);
+}
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool(configuredThreads);
+    return pool;
+}
+void ThreadPool::configure(size_t threads) { configuredThreads = threads; }
+
+// -------------------------------------------------- Память запроса --------------------------------------------------
+namespace {
+// Счётчики всех арен процесса
+struct ArenaCounters {
+    std::atomic<size_t> requests{ 0 }, bytes{ 0 }, peakBytes{ 0 }, heapBlocks{ 0 }, heapBytes{ 0 };
+};
+ArenaCounters arenaCounters;
+thread_local std::pmr::memory_resource* currentArena = nullptr;
+}
+RequestArena::RequestArena(size_t initialBytes)
+    : initial(new std::byte[initialBytes]), buffer(initial.get(), initialBytes, &upstream) {}
+void RequestArena::reset() {
+    arenaCounters.requests.fetch_add(1, std::memory_order_relaxed);
+    arenaCounters.bytes.fetch_add(used, std::memory_order_relaxed);
+    size_t peak = arenaCounters.peakBytes.load(std::memory_order_relaxed);
+    while (used > peak && !arenaCounters.peakBytes.compare_exchange_weak(peak, used, std::memory_order_relaxed)) {}
+    buffer.release(); // блоки сверх начального — обратно в кучу, следующий запрос снова с начала начального блока
+    used = 0;
+}
+std::pmr::memory_resource* RequestArena::current() {
+    return currentArena ? currentArena : std::pmr::get_default_resource();
+}
+RequestArena::Scope::Scope(RequestArena& arena) : arena(arena), previous(currentArena) {
+    currentArena = &arena;
+}
+RequestArena::Scope::~Scope() {
+    currentArena = previous;
+    if (previous != &arena) arena.reset(); // вложенная область той же арены не освобождает память внешней
+}
+RequestArena::Stats RequestArena::stats() {
+    return Stats{ arenaCounters.requests.load(), arenaCounters.bytes.load(), arenaCounters.peakBytes.load(),
+                  arenaCounters.heapBlocks.load(), arenaCounters.heapBytes.load() };
+}
+void* RequestArena::do_allocate(size_t bytes, size_t alignment) {
+    used += bytes;
+    return buffer.allocate(bytes, alignment);
 }
+void* RequestArena::Upstream::do_allocate(size_t bytes, size_t alignment) {
+    arenaCounters.heapBlocks.fetch_add(1, std::memory_order_relaxed);
+    arenaCounters.heapBytes.fetch_add(bytes, std::memory_order_relaxed);
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+}
+void RequestArena::Upstream::do_deallocate(void* p, size_t bytes, size_t alignment) {
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+}
+
+// -------------------------------------------------- Отмена и срок запроса --------------------------------------------------
+namespace {
+thread_local RequestControl* currentControl = nullptr;
+}
+void RequestControl::start(Clock::time_point deadline) {
+    this->deadline = deadline;
+    cancelled.store(false, std::memory_order_relaxed);
+}
+void RequestControl::check() const {
+    if (isCancelled()) throw RequestInterrupted(false);
+    if (deadline != Clock::time_point::max() && isExpired()) throw RequestInterrupted(true);
+}
+RequestControl* RequestControl::current() {
+    return currentControl;
+}
+void RequestControl::checkpoint() {
+    if (currentControl) currentControl->check();
+}
+RequestControl::Scope::Scope(RequestControl& control) : previous(currentControl) {
+    currentControl = &control;
+}
+RequestControl::Scope::~Scope() {
+    currentControl = previous;
+}
+
+// -------------------------------------------------- Трассировка запроса --------------------------------------------------
+namespace {
+thread_local RequestTrace* currentTrace = nullptr;
+}
+void RequestTrace::start(Clock::time_point begin) {
+    beginTime = begin;
+    list.clear();
+    droppedSpans = 0;
+}
+void RequestTrace::add(const char* name, Clock::time_point start, Clock::time_point end) {
+    if (list.size() >= maxSpans) {
+        ++droppedSpans;
+        return;
+    }
+    list.push_back(Span{ name, start, end });
+}
+RequestTrace* RequestTrace::current() {
+    return currentTrace;
+}
+RequestTrace::Scope::Scope(RequestTrace* trace) : previous(currentTrace) {
+    currentTrace = trace;
+}
+RequestTrace::Scope::~Scope() {
+    currentTrace = previous;
+}
+
+// -------------------------------------------------- Фоновая запись снимков --------------------------------------------------
+SnapshotWriter::SnapshotWriter() {
+    worker = std::thread([this]() { writerLoop(); }); // после инициализации очереди и мьютекса
+}
+SnapshotWriter::~SnapshotWriter() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+}
+SnapshotWriter& SnapshotWriter::instance() {
+    static SnapshotWriter writer;
+    return writer;
+}
+void SnapshotWriter::enqueue(Job job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(job));
+    }
+    cv.notify_one();
+}
+void SnapshotWriter::writerLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) return; // при остановке сначала дописываем всю очередь
+            job = std::move(queue.front());
+            queue.pop_front();
+        }
+        bool ok = writeFile(job);
+        if (job.done) job.done(ok);
+    }
+}
+// Временный файл → fsync → rename → fsync каталога: после возврата true снимок на диске целиком,
+// а тот, кто уже открыл старый файл (например, отдаёт его через sendfile), дочитает старый снимок
+bool SnapshotWriter::writeFile(const Job& job) {
+    const std::string& path = job.path;
+    const std::string& data = job.data;
+    std::string tmpPath = path + ".tmp";
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    for (size_t written = 0; ok && written < data.size();) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = false;
+        else written += (size_t)n;
+    }
+    ok = ok && fsync(fd) == 0;
+    if (ok && job.written) job.written(fd);
+    ok = close(fd) == 0 && ok;
+    if (!ok || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    if (int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+}
+
+// -------------------------------------------------- Параллельная сортировка --------------------------------------------------
+// Ключ из первых четырёх символов ФИО по 16 бит: если key(a) < key(b), то wcscmp(a, b) < 0.
+// Символ >= 0xFFFF не помещается в 16 бит, поэтому после него ключ обрывается (равные ключи досортирует компаратор)
+static uint64_t namePrefixKey(const wchar_t* name) {
+    uint64_t key = 0;
+    bool stop = false;
+    for (int i = 0; i < 4; ++i) {
+        uint64_t c = 0;
+        if (!stop) {
+            uint32_t ch = (uint32_t)name[i];
+            if (ch == 0) stop = true;
+            else if (ch >= 0xFFFF) c = 0xFFFF, stop = true;
+            else c = ch;
+        }
+        key = key << 16 | c;
+    }
+    return key;
+}
+// Ключ группы: int со сдвигом знака, чтобы порядок беззнаковых ключей совпадал с порядком int
+static uint64_t groupKey(int group) {
+    return (uint32_t)group ^ 0x80000000u;
+}
+// Стабильная сортировка номеров записей: LSD-radix по парам (ключ, номер), затем серии с равным ключом
+// досортировываются компаратором tieLess (если задан). Выше порога гистограммы, раскладка и досортировка идут на пуле потоков.
+// С control между проходами и пачками досортировки проверяются отмена и срок запроса (сортировка для print; при изменении
+// записей её прерывать нельзя). Буферы берутся из того же источника памяти, что и rows
+static void sortRowsByKey(std::pmr::vector<size_t>& rows, size_t parallelThreshold,
+                          const std::function<uint64_t(size_t)>& key,
+                          const std::function<bool(size_t, size_t)>& tieLess,
+                          const RequestControl* control = nullptr) {
+    struct Item { uint64_t key; size_t row; };
+    const size_t n = rows.size();
+    if (n < 2) return;
+    ThreadPool& pool = ThreadPool::instance();
+    const size_t chunks = n >= parallelThreshold ? std::min(pool.size(), n) : 1;
+    const size_t chunk = (n + chunks - 1) / chunks;
+    auto chunkRange = [&](size_t c) { return std::make_pair(c * chunk, std::min(n, (c + 1) * chunk)); };
 
-// -------------------------------------------------- Компараторы для деревьев --------------------------------------------------
+    std::pmr::memory_resource* memory = rows.get_allocator().resource();
+    std::pmr::vector<Item> items(n, memory), buffer(n, memory);
+    std::vector<uint64_t> orBits(chunks, 0), andBits(chunks, ~0ull);
+    pool.parallelFor(chunks, [&](size_t c) {
+        auto [from, to] = chunkRange(c);
+        for (size_t i = from; i < to; ++i) {
+            items[i] = { key(rows[i]), rows[i] };
+            orBits[c] |= items[i].key;
+            andBits[c] &= items[i].key;
+        }
+    });
+    uint64_t varying = 0, common = ~0ull;
+    for (size_t c = 0; c < chunks; ++c) varying |= orBits[c], common &= andBits[c];
+    varying ^= common & varying; // биты, которые различаются хотя бы у двух ключей
+
+    // Проходы только по байтам ключа, которые реально различаются
+    std::vector<std::array<size_t, 256>> hist(chunks);
+    for (int shift = 0; shift < 64; shift += 8) {
+        if (((varying >> shift) & 0xFF) == 0) continue;
+        if (control) control->check();
+        pool.parallelFor(chunks, [&](size_t c) {
+            hist[c].fill(0);
+            auto [from, to] = chunkRange(c);
+            for (size_t i = from; i < to; ++i) ++hist[c][(items[i].key >> shift) & 0xFF];
+        });
+        size_t offset = 0;
+        for (size_t d = 0; d < 256; ++d)
+            for (size_t c = 0; c < chunks; ++c) {
+                size_t count = hist[c][d];
+                hist[c][d] = offset;
+                offset += count;
+            }
+        pool.parallelFor(chunks, [&](size_t c) {
+            auto [from, to] = chunkRange(c);
+            for (size_t i = from; i < to; ++i) buffer[hist[c][(items[i].key >> shift) & 0xFF]++] = items[i];
+        });
+        items.swap(buffer);
+    }
+
+    // Досортировка серий с равным ключом: серии режутся на пачки примерно равного размера
+    if (tieLess) {
+        std::vector<size_t> batches{ 0 };
+        const size_t batchSize = std::max<size_t>(4096, n / (chunks * 8));
+        for (size_t i = 1; i < n; ++i)
+            if (items[i].key != items[i - 1].key && i - batches.back() >= batchSize) batches.push_back(i);
+        batches.push_back(n);
+        pool.parallelFor(batches.size() - 1, [&](size_t b) {
+            if (control) control->check();
+            for (size_t from = batches[b]; from < batches[b + 1];) {
+                size_t to = from + 1;
+                while (to < batches[b + 1] && items[to].key == items[from].key) ++to;
+                if (to - from > 1)
+                    std::stable_sort(items.begin() + from, items.begin() + to,
+                                     [&](const Item& a, const Item& b) { return tieLess(a.row, b.row); });
+                from = to;
+            }
+        });
+    }
+    pool.parallelFor(chunks, [&](size_t c) {
+        auto [from, to] = chunkRange(c);
+        for (size_t i = from; i < to; ++i) rows[i] = items[i].row;
+    });
+}
+
+// ---------------------------------------------- Компараторы индексных массивов ----------------------------------------------
 // ------------------- Реализация CompareByName -------------------
 bool Database::CompareByName::operator()(Index a, const wchar_t* b) const {
     size_t len = wcslen(b) - 1;
@@ -69,18 +595,18 @@ bool Database::CompareByGroup::operator()(Index a, Index b) const {
                (*students_ptr)[(size_t)b].group;
     return a < b;
 }
-// ------------------- Реализация CompareByRating -------------------
-bool Database::CompareByRating::operator()(Index a, double rating) const {
-    return (*students_ptr)[(size_t)a].rating < rating;
+// ------------------- Реализация CompareById -------------------
+bool Database::CompareById::operator()(Index a, int id) const {
+    return (*students_ptr)[(size_t)a].id < id;
 }
-bool Database::CompareByRating::operator()(double rating, Index b) const {
-    return rating < (*students_ptr)[(size_t)b].rating;
+bool Database::CompareById::operator()(int id, Index b) const {
+    return id < (*students_ptr)[(size_t)b].id;
 }
-bool Database::CompareByRating::operator()(Index a, Index b) const {
-    if ((*students_ptr)[(size_t)a].rating !=
-        (*students_ptr)[(size_t)b].rating)
-        return (*students_ptr)[(size_t)a].rating <
-               (*students_ptr)[(size_t)b].rating;
+bool Database::CompareById::operator()(Index a, Index b) const {
+    if ((*students_ptr)[(size_t)a].id !=
+        (*students_ptr)[(size_t)b].id)
+        return (*students_ptr)[(size_t)a].id <
+               (*students_ptr)[(size_t)b].id;
     return a < b;
 }
 
@@ -93,33 +619,192 @@ bool validate_name(const std::wstring& name) {
 bool validate_group(int group) {
     return group > 0;
 }
-// Валидация оценки (2.0 <= x <= 5.0)
+// Валидация оценки (2.0 <= x <= 5.0, одна цифра после запятой)
 bool validate_rating(double rating) {
-    return rating >= 2.0 && rating <= 5.0;
+    return rating >= 2.0 && rating <= 5.0 && std::fabs(rating * 10 - std::round(rating * 10)) < 1e-6;
+}
+// Оценка в десятых долях (с округлением и приведением к диапазону 2.0..5.0)
+static unsigned char toRating10(double rating) {
+    long tenths = std::lround(rating * 10);
+    return (unsigned char)std::clamp(tenths, 20L, 50L);
+}
+// Границы критерия по оценке в десятых: "4", "3.5-4.5", "*-4", "4-*" (lo > hi — ничего не подходит; false — не число)
+static bool ratingBounds(std::string_view value, int& lo, int& hi) {
+    double rating;
+    size_t dashPos = value.find('-');
+    if (dashPos == std::string_view::npos) {
+        if (!parseNumber(value, rating)) return false;
+        lo = hi = (int)std::lround(rating * 10);
+        if (std::fabs(rating * 10 - lo) > 1e-6) lo = 1, hi = 0; // у записей только одна цифра после запятой
+        return true;
+    }
+    std::string_view startStr = value.substr(0, dashPos);
+    std::string_view endStr = value.substr(dashPos + 1);
+    if (startStr == "*") lo = 0;
+    else if (parseNumber(startStr, rating)) lo = (int)std::ceil(rating * 10 - 1e-6);
+    else return false;
+    if (endStr == "*") hi = 100;
+    else if (parseNumber(endStr, rating)) hi = (int)std::floor(rating * 10 + 1e-6);
+    else return false;
+    return true;
 }
 
 
+// -------------------------------------------------- Приватные функции-помощники --------------------------------------------------
+// Отпечаток файла на диске (устройство, inode, размер, время изменения)
+bool Database::statFile(const std::string& path, FileStamp& stamp, int fd) {
+    struct stat st;
+    if ((fd >= 0 ? fstat(fd, &st) : stat(path.c_str(), &st)) != 0) return false;
+    stamp.dev = st.st_dev;
+    stamp.ino = st.st_ino;
+    stamp.size = st.st_size;
+    stamp.mtime_sec = st.st_mtim.tv_sec;
+    stamp.mtime_nsec = st.st_mtim.tv_nsec;
+    return true;
+}
+std::string Database::fileKey(const std::string& path) {
+    std::string key = path;
+    if (char* real = ::realpath(path.c_str(), nullptr)) {
+        key = real;
+        free(real);
+    }
+    return key;
+}
+bool Database::FileStamp::operator==(const FileStamp& other) const {
+    return dev == other.dev && ino == other.ino && size == other.size &&
+           mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec;
+}
+// Оценка в том же виде, что выводит поток по умолчанию (%g): 4, 4.5 — целая часть и десятые без плавающей точки
+static void appendRating(std::string& out, int rating10) {
+    char buf[16];
+    char* end = std::to_chars(buf, buf + sizeof(buf), rating10 / 10).ptr;
+    if (rating10 % 10) {
+        *end++ = '.';
+        *end++ = char('0' + rating10 % 10);
+    }
+    out.append(buf, end);
+}
+// Совпадает ли строка файла побайтно с тем, что напечатает print: id, ФИО без обрезки, группа и оценка в каноничном виде
+static bool isCanonicalLine(const std::string& line, int id, bool nameKept, int group, int rating10) {
+    if (!nameKept) return false;
+    size_t p0 = line.find('\t');
+    if (p0 == std::string::npos || line.compare(0, p0, std::to_string(id)) != 0) return false;
+    size_t p1 = line.find('\t', p0 + 1);
+    if (p1 == std::string::npos) return false;
+    size_t p2 = line.find('\t', p1 + 1);
+    if (p2 == std::string::npos || line.compare(p1 + 1, p2 - p1 - 1, std::to_string(group)) != 0) return false;
+    size_t p3 = line.find('\t', p2 + 1);
+    std::string rating;
+    appendRating(rating, rating10);
+    return p3 != std::string::npos && line.compare(p2 + 1, p3 - p2 - 1, rating) == 0;
+}
+
 // -------------------------------------------------- Приватные функции-помощники --------------------------------------------------
 // Загрузка бд из файла
-void Database::loadFromFile(const std::wstring& filename) {
+bool Database::loadFromFile(const std::wstring& filename) {
     // Открываем файл для чтения в UTF-8
-    std::ifstream file(utf16_to_utf8(filename));
+    std::string path = utf16_to_utf8(filename);
+    std::ifstream file(path);
     if (!file.is_open()) {
         std::wcout << L"Ошибка: не удалось открыть файл " << filename << L"\n";
-        return;
+        return false;
     }
+    // Свои сохранения должны дойти до диска раньше, чем мы перечитаем файл
+    if (!waitSaved())
+        std::wcout << L"Ошибка: не удалось сохранить предыдущие изменения (фоновая запись)\n";
+    FileStamp before, after;
+    bool stamped = statFile(path, before);
+    std::string key = fileKey(path);
 
-    // Очищаем существующие данные
+    // Очищаем существующие данные (фоновое построение индексов читает записи — дожидаемся его)
+    waitIndexBuilder();
     students.clear();
-    studentsBN.clear();
-    studentsBG.clear();
-    studentsBR.clear();
-    selectedStudents.clear();
+    lineOffsets.clear();
     nextId = 1;
 
+    size_t fixedRatings = 0; // оценки вне 2.0..5.0 или с лишними знаками, приведённые к допустимым
+    // Файл не менялся с прошлой загрузки — копируем записи из кэша вместо разбора
+    std::shared_ptr<const CachedTable> cached;
+    if (stamped) {
+        FileRegistry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        if (auto it = reg.files.find(key); it != reg.files.end() && it->second.cached && it->second.cached->stamp == before) {
+            cached = it->second.cached;
+            ++reg.hits;
+        }
+        else ++reg.misses;
+    }
+    if (cached) {
+        students = cached->students;
+        lineOffsets = cached->lineOffsets;
+        nextId = cached->nextId;
+        fileCanonical = cached->canonical;
+        fixedRatings = cached->fixedRatings;
+    }
+    else {
+        CachedTable table;
+        readTable(file, table);
+        students = std::move(table.students);
+        lineOffsets = std::move(table.lineOffsets);
+        nextId = table.nextId;
+        fileCanonical = stamped && table.canonical;
+        fixedRatings = table.fixedRatings;
+    }
+    rebuildIndexes();
+
+    file.close();
+    // Если файл меняли, пока мы его читали, смещениям доверять нельзя (и в кэш такие записи не кладём)
+    bool unchanged = cached || (stamped && statFile(path, after) && after == before);
+    if (cached) after = before;
+    if (!unchanged) fileCanonical = false;
+    {
+        std::lock_guard<std::mutex> lock(saveState->mutex);
+        saveState->stamp = after;
+        saveState->stampValid = fileCanonical;
+    }
+    size_t bytes = tableBytes(students, lineOffsets);
+    registerFile(key, students.size(), bytes + (4 * students.size() + nextId) * sizeof(size_t));
+    FileRegistry& reg = registry();
+    if (!cached && unchanged && reg.budget) {
+        bool fits;
+        {
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            trimCache(reg, bytes);
+            fits = reg.cachedBytes + bytes <= reg.budget;
+        }
+        // Копия записей для кэша готовится без блокировки; если бюджет не позволяет, файл не кэшируется
+        if (fits) {
+            auto table = std::make_shared<CachedTable>();
+            table->stamp = before;
+            table->students = students;
+            table->lineOffsets = lineOffsets;
+            table->canonical = fileCanonical;
+            table->nextId = nextId;
+            table->fixedRatings = fixedRatings;
+            table->bytes = bytes;
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            OpenFile& entry = reg.files[key];
+            if (entry.cached) reg.cachedBytes -= entry.cached->bytes;
+            entry.cached = std::move(table);
+            reg.cachedBytes += bytes;
+            trimCache(reg);
+        }
+    }
+    std::wcout << L"База данных загружена из " << filename << L"(" << students.size() << L")" << (cached ? L" из кэша" : L"") << L"\n";
+    if (fixedRatings)
+        std::wcout << L"Предупреждение: оценок вне диапазона 2.0-5.0 или с лишними знаками приведено к допустимым: " << fixedRatings << L"\n";
+    return true;
+}
+// Разбор файла БД: записи, смещения строк и признак того, что файл совпадает с форматом print
+void Database::readTable(std::istream& file, CachedTable& table) {
     Student temp;
     std::string line;
+    off_t offset = 0;
+    table.canonical = true;
     while (std::getline(file, line)) {
+        table.lineOffsets.push_back(offset);
+        offset += line.size() + 1;
+        if (file.eof()) table.canonical = false; // последняя строка без \n, а print её допишет
         // Конвертируем строку UTF-8 в wstring (UTF-16)
         std::wstring wline = utf8_to_utf16(line);
         std::wistringstream iss(wline);
@@ -131,612 +816,1886 @@ void Database::loadFromFile(const std::wstring& filename) {
             std::getline(iss, name, L'\t');
         }
         else {
-            temp.id = nextId++;
+            temp.id = table.nextId++;
             name = id_str;
+            table.canonical = false;
         }
         // Копируем имя в temp.name, учитывая максимальную длину 64
         wcsncpy(temp.name, name.c_str(), 63);
         temp.name[63] = L'\0'; // Гарантируем завершающий нуль
 
-        iss >> temp.group >> temp.rating;
+        double rating = 0;
+        iss >> temp.group >> rating;
         iss.ignore(1);
         std::getline(iss, temp.info);
+        temp.rating10 = toRating10(rating);
+        if (!validate_rating(rating)) ++table.fixedRatings;
 
-        students.push_back(temp);
-        studentsBN.insert(Index{ students.size() - 1 });
-        studentsBG.insert(Index{ students.size() - 1 });
-        studentsBR.insert(Index{ students.size() - 1 });
-        if (temp.id >= nextId) nextId = temp.id + 1;
-    }
-
-    selectedStudents.reserve(students.size());
-    selectedStudents.resize(students.size());
-    for (size_t i = 0; i < students.size(); ++i)
-        selectedStudents[i] = i;
+        if (table.canonical)
+            table.canonical = isCanonicalLine(line, temp.id, name.size() < 63, temp.group, temp.rating10);
 
-    file.close();
-    std::wcout << L"База данных загружена из " << filename << L"(" << students.size() << L")\n";
+        table.students.push_back(temp);
+        if (temp.id >= table.nextId) table.nextId = temp.id + 1;
+    }
+    table.lineOffsets.push_back(offset);
+}
+// Строка записи в формате файла и print (UTF-8, с \n)
+std::string Database::formatLine(const Student& student) {
+    std::string line;
+    appendRow(line, student, {});
+    return line;
 }
 // Сохранение БД в файл
 void Database::saveToFile(const std::wstring& filename) {
-    // Открываем файл для записи в UTF-8
-    std::ofstream file(utf16_to_utf8(filename));
-    file.imbue(std::locale(file.getloc(), new NoSeparator));
-    if (!file.is_open()) {
-        std::wcout << L"Ошибка: не удалось сохранить файл " << filename << L"\n";
-        return;
+    // Сначала сообщаем о неудачных фоновых записях прошлых сохранений
+    {
+        std::lock_guard<std::mutex> lock(saveState->mutex);
+        if (saveState->failed) {
+            std::wcout << L"Ошибка: не удалось сохранить файл " << filename << L" (фоновая запись)\n";
+            saveState->failed = 0;
+        }
+        ++saveState->pending;
+        saveState->stampValid = false; // пока снимок не записан, файл не совпадает с памятью
+        // Изменения неудачных записей подписчикам ещё не ушли — отправим их с этим сохранением (строки — текущие)
+        pendingChanges.inserted.insert(pendingChanges.inserted.end(), saveState->unsentInserted.begin(), saveState->unsentInserted.end());
+        pendingChanges.updated.insert(pendingChanges.updated.end(), saveState->unsentUpdated.begin(), saveState->unsentUpdated.end());
+        pendingChanges.deleted.insert(pendingChanges.deleted.end(), saveState->unsentDeleted.begin(), saveState->unsentDeleted.end());
+        pendingChanges.reload = pendingChanges.reload || saveState->unsentReload;
+        saveState->unsentInserted.clear();
+        saveState->unsentUpdated.clear();
+        saveState->unsentDeleted.clear();
+        saveState->unsentReload = false;
     }
-
-    for (const auto& student : students) {
-        std::wstring name_wstr(student.name);
-        std::string name_utf8 = utf16_to_utf8(name_wstr);
-        std::string info_utf8 = utf16_to_utf8(student.info);
-        file << student.id << "\t" << name_utf8 << "\t" << student.group << "\t" << student.rating << "\t" << info_utf8 << "\n";
+    // Файл сейчас перезапишется — его записи в кэше устарели, а перечитанное после записи извне
+    // этому экземпляру применять уже не нужно: в файл ляжут его записи
+    std::string key = fileKey(utf16_to_utf8(filename));
+    {
+        FileRegistry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        if (auto it = reg.files.find(key); it != reg.files.end()) {
+            OpenFile& entry = it->second;
+            if (entry.cached) {
+                reg.cachedBytes -= entry.cached->bytes;
+                entry.cached.reset();
+            }
+            if (key == registeredPath && syncedGeneration != entry.generation) {
+                syncedGeneration = entry.generation;
+                if (entry.unsynced && --entry.unsynced == 0) entry.latest.reset();
+            }
+        }
     }
-
-    file.close();
-    notifyChanged();
-}
-// Парсинг критериев из команды (строка "name=Кузьмин* group=101-103" разобьется на пары ключ-значение: [field]: value (["name"]: "Кузьмин*", ["group"]: "101-103"))
-std::map<std::wstring, std::wstring> Database::parseCriteria(const std::wstring& command) const {
-    std::map<std::wstring, std::wstring> result;
-
-    // Регулярное выражение для поиска пар ключ=значение
-    std::wregex pattern(LR"((\w+)=("[^"]*"|[^\s]*))");
-    std::wsregex_iterator it(command.begin(), command.end(), pattern);
-    std::wsregex_iterator end;
-
-    while (it != end) {
-        std::wsmatch match = *it;
-        std::wstring key = match[1].str();
-        std::wstring value = match[2].str();
-
-        // Удаляем кавычки, если они есть
-        if (value.size() >= 2 && value.front() == L'"' && value.back() == L'"') {
-            value = value.substr(1, value.size() - 2);
+    // Снимок: строки всех записей в формате файла (выше порога — морселями на пуле потоков).
+    // Дальше сеанс может менять записи — поток записи работает только со своей копией строк
+    const size_t morsel = 16384;
+    const size_t morsels = (students.size() + morsel - 1) / morsel;
+    std::vector<std::string> parts(morsels);
+    std::vector<size_t> lengths(students.size());
+    auto formatMorsel = [&](size_t m) {
+        size_t to = std::min(students.size(), (m + 1) * morsel);
+        for (size_t k = m * morsel; k < to; ++k) {
+            std::string line = formatLine(students[k]);
+            lengths[k] = line.size();
+            parts[m] += line;
         }
+    };
+    if (students.size() >= parallelThreshold) ThreadPool::instance().parallelFor(morsels, formatMorsel);
+    else for (size_t m = 0; m < morsels; ++m) formatMorsel(m);
 
-        result[key] = value;
-        ++it;
+    SnapshotWriter::Job job;
+    job.path = utf16_to_utf8(filename);
+    lineOffsets.resize(students.size() + 1);
+    lineOffsets[0] = 0;
+    for (size_t k = 0; k < students.size(); ++k) lineOffsets[k + 1] = lineOffsets[k] + (off_t)lengths[k];
+    job.data.reserve((size_t)lineOffsets.back());
+    for (const auto& part : parts) job.data += part;
+    fileCanonical = true;
+    // Другие экземпляры этого файла получают записи сохранения через реестр, когда файл записан (job.done),
+    // и применяют их перед своей следующей командой — к тому времени, как их клиенты получат оповещение,
+    // print и page уже вернут новые записи. Неудачная запись не публикуется: у других остаётся то, что на диске
+    bool peers;
+    {
+        FileRegistry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        auto it = reg.files.find(key);
+        peers = it != reg.files.end() && key == registeredPath && it->second.sessions > 1;
+    }
+    std::shared_ptr<CachedTable> peerTable;
+    if (peers) {
+        peerTable = std::make_shared<CachedTable>();
+        peerTable->students = students;
+        peerTable->lineOffsets = lineOffsets;
+        peerTable->canonical = true;
+        peerTable->nextId = nextId;
+        peerTable->bytes = tableBytes(peerTable->students, peerTable->lineOffsets);
+        peerTable->peerSave = true;
     }
 
-    return result;
-}
-// Проверка соответствия записи критериям(тем самым парам ключ-значение)
-bool Database::matchesCriteria(const Student& student, const std::map<std::wstring, std::wstring>& criteria) const {
-    for (const auto& crit : criteria) {
-        const std::wstring& field = crit.first;
-        const std::wstring& value = crit.second;
-
-        if (value == L"*")
-            continue;
-
-        if (field == L"id") {
-            int id = student.id;
-            size_t dashPos = value.find(L'-');
-            if (dashPos != std::wstring::npos) {
-                std::wstring startStr = value.substr(0, dashPos);
-                std::wstring endStr = value.substr(dashPos + 1);
-                int start = startStr == L"*" ? std::numeric_limits<int>::min() : std::stoi(startStr);
-                int end = endStr == L"*" ? std::numeric_limits<int>::max() : std::stoi(endStr);
-                if (id < start || id > end) {
-                    return false;
+    // Подписчиков оповещаем после rename: перечитав файл по оповещению, они увидят уже новый снимок
+    ChangeSet changes = takeChanges();
+    job.done = [state = saveState, path = job.path, callbacks = changeCallbacks, savedVersion = version,
+                changes = std::move(changes), key, writer = instanceId, peerTable = std::move(peerTable)](bool ok) {
+        FileStamp stamp;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            if (ok) {
+                ok = statFile(path, stamp);
+                if (--state->pending == 0 && ok) { // файл совпадает с памятью, только если после него ничего не ставили в очередь
+                    state->stamp = stamp;
+                    state->stampValid = true;
                 }
             }
-            else {
-                if (std::to_wstring(id) != value) {
-                    return false;
-                }
+            else --state->pending;
+            if (!ok) {
+                ++state->failed;
+                state->unsentInserted.insert(state->unsentInserted.end(), changes.inserted.begin(), changes.inserted.end());
+                state->unsentUpdated.insert(state->unsentUpdated.end(), changes.updated.begin(), changes.updated.end());
+                state->unsentDeleted.insert(state->unsentDeleted.end(), changes.deleted.begin(), changes.deleted.end());
+                state->unsentReload = state->unsentReload || changes.reload;
             }
         }
-        else if (field == L"name") {
-            // Заменяем * в критерии на .* (в regex это "любое количество любых символов")
-            std::wstring regexPattern = L"^"; // ^ - начало строки
-            size_t lastPos = 0;
-            size_t starPos = value.find(L'*');
-
-            // Разбиваем критерий на части и заменяем * на .*
-            while (starPos != std::string::npos) {
-                regexPattern += value.substr(lastPos, starPos - lastPos) + L".*";
-                lastPos = starPos + 1;
-                starPos = value.find(L'*', lastPos);
+        state->cv.notify_all();
+        if (!ok) return;
+        if (peerTable) {
+            // Записи этого снимка — новое содержимое файла для остальных экземпляров (записавшему применять нечего)
+            peerTable->stamp = stamp;
+            FileRegistry& reg = registry();
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            if (auto it = reg.files.find(key); it != reg.files.end() && it->second.sessions) {
+                OpenFile& entry = it->second;
+                ++entry.generation;
+                entry.latest = std::move(peerTable);
+                entry.latestWriter = writer;
+                entry.unsynced = entry.sessions;
+                entry.records = entry.latest->students.size();
             }
-            regexPattern += value.substr(lastPos) + L"$"; // $ - конец строки
-
-            // Создаём regex и проверяем совпадение
-            std::wregex re(regexPattern);
-            if (!std::regex_search(student.name, re)) {
+        }
+        for (auto& cb : callbacks) cb(savedVersion, changes);
+    };
+    // Своё сохранение слежение за файлом узнаёт по отпечатку временного файла (rename его не меняет)
+    job.written = [key, writer = instanceId](int fd) {
+        FileStamp stamp;
+        if (!statFile("", stamp, fd)) return;
+        FileRegistry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        if (auto it = reg.files.find(key); it != reg.files.end() && reg.watching)
+            it->second.ownWrites.push_back({ stamp, writer });
+    };
+    SnapshotWriter::instance().enqueue(std::move(job));
+}
+// Дождаться записи на диск всех сохранений сеанса
+bool Database::waitSaved() {
+    std::unique_lock<std::mutex> lock(saveState->mutex);
+    saveState->cv.wait(lock, [this]() { return saveState->pending == 0; });
+    bool ok = saveState->failed == 0;
+    saveState->failed = 0;
+    return ok;
+}
+// Критерии команды по полям схемы: значения разбираются один раз, дальше на каждой записи только сравнения
+bool Database::compileCriteria(std::string_view command, Criteria& criteria, bool report) {
+    TraceSpan span("compileCriteria");
+    CriteriaTokens tokens = lex_criteria(command);
+    if (tokens.error) {
+        if (report) commandError(tokens.error, tokens.errorAt);
+        return false;
+    }
+    if (tokens.where) {
+        if (report) commandError(L"where допускается только в update и remove", "where");
+        return false;
+    }
+    for (const CriterionToken& token : tokens) {
+        if (token.field == "range") { // диапазон вывода page, а не условие: not и or к нему не относятся
+            if (token.negate || token.orBefore) {
+                if (report) commandError(token.negate ? L"not не применяется к range" : L"or не применяется к range", token.field);
                 return false;
             }
+            continue;
         }
-        else if (field == L"group") {
-            int group = student.group;
-            size_t dashPos = value.find(L'-');
-            if (dashPos != std::wstring::npos) {
-                std::wstring startStr = value.substr(0, dashPos);
-                std::wstring endStr = value.substr(dashPos + 1);
-                int start = startStr == L"*" ? std::numeric_limits<int>::min() : std::stoi(startStr);
-                int end = endStr == L"*" ? std::numeric_limits<int>::max() : std::stoi(endStr);
-                if (group < start || group > end) {
-                    return false;
-                }
+        int field = fieldNumber(token.field);
+        if (field < 0) {
+            if (report) commandError(L"неизвестное поле", token.field);
+            return false;
+        }
+        if (!token.listItem) { // новое условие; or начинает новую ветку
+            if (token.orBefore || criteria.branchCount == 0) ++criteria.branchCount;
+            criteria.predicates[criteria.predicateCount++] = Predicate{ field, token.negate, criteria.valueCount, 0 };
+            criteria.branchEnd[criteria.branchCount - 1] = criteria.predicateCount;
+        }
+        Criterion& criterion = criteria.values[criteria.valueCount];
+        criterion.field = field;
+        criterion.index = fieldOps[field].index;
+        criterion.test = fieldOps[field].test;
+        if (const wchar_t* error = fieldOps[field].compile(criterion, token.value)) {
+            if (report) commandError(error, token.value);
+            return false;
+        }
+        ++criteria.valueCount;
+        ++criteria.predicates[criteria.predicateCount - 1].count;
+    }
+    return true;
+}
+// Проверка соответствия записи критериям: подходит хотя бы одна ветка
+bool Database::matchesCriteria(const Student& student, const Criteria& criteria) {
+    if (criteria.empty()) return true;
+    for (size_t branch = 0; branch < criteria.branchCount; ++branch)
+        if (matchesBranch(student, criteria, branch)) return true;
+    return false;
+}
+// Запись подходит под все условия ветки
+bool Database::matchesBranch(const Student& student, const Criteria& criteria, size_t branch) {
+    for (size_t p = criteria.branchBegin(branch); p < criteria.branchEnd[branch]; ++p)
+        if (!matchesPredicate(student, criteria, criteria.predicates[p])) return false;
+    return true;
+}
+// Запись подходит под условие: совпадает хотя бы одно значение списка (с not — ни одно)
+bool Database::matchesPredicate(const Student& student, const Criteria& criteria, const Predicate& predicate) {
+    bool matched = false;
+    for (const Criterion* value = criteria.begin(predicate); value != criteria.end(predicate) && !matched; ++value)
+        matched = value->any || value->test(*value, student);
+    return matched != predicate.negate;
+}
+
+// -------------------------------------------------- Схема записи --------------------------------------------------
+// Символ слова для поиска по info: латиница, кириллица и цифры
+static bool isWordChar(wchar_t c) {
+    return (c >= L'0' && c <= L'9') || (c >= L'a' && c <= L'z') || (c >= L'A' && c <= L'Z') ||
+           (c >= L'А' && c <= L'я') || c == L'Ё' || c == L'ё';
+}
+// Символ слова в нижнем регистре (ё совпадает с е), без зависимости от локали
+static wchar_t foldChar(wchar_t c) {
+    if ((c >= L'A' && c <= L'Z') || (c >= L'А' && c <= L'Я')) return c + 32;
+    if (c == L'Ё' || c == L'ё') return L'е';
+    return c;
+}
+// Есть ли в тексте слово term (prefix — слово, начинающееся с term); term уже в нижнем регистре
+static bool hasWord(const wchar_t* text, const std::wstring& term, bool prefix) {
+    while (*text) {
+        while (*text && !isWordChar(*text)) ++text;
+        const wchar_t* start = text;
+        while (isWordChar(*text)) ++text;
+        size_t length = text - start;
+        if (length < term.size() || (!prefix && length != term.size())) continue;
+        size_t k = 0;
+        while (k < term.size() && foldChar(start[k]) == term[k]) ++k;
+        if (k == term.size()) return true;
+    }
+    return false;
+}
+// Совпадение с маской: * — любое количество любых символов (с возвратом к последней *, без regex)
+static bool maskMatch(const wchar_t* text, const wchar_t* mask) {
+    const wchar_t* star = nullptr;
+    const wchar_t* resume = nullptr;
+    while (*text) {
+        if (*mask == L'*') {
+            star = mask++;
+            resume = text;
+        }
+        else if (*mask == *text) {
+            ++mask;
+            ++text;
+        }
+        else if (star) {
+            mask = star + 1;
+            text = ++resume;
+        }
+        else return false;
+    }
+    while (*mask == L'*') ++mask;
+    return !*mask;
+}
+// Сравнение с границей диапазона: граница с * на конце сравнивается как префикс (как в индексе ФИО)
+static int compareBound(const wchar_t* text, const std::wstring& bound) {
+    if (!bound.empty() && bound.back() == L'*') return wcsncmp(text, bound.c_str(), bound.size() - 1);
+    return wcscmp(text, bound.c_str());
+}
+static const wchar_t* textOf(const wchar_t* value) { return value; }
+static const wchar_t* textOf(const std::wstring& value) { return value.c_str(); }
+
+template <typename F>
+const wchar_t* Database::compileField(Criterion& criterion, std::string_view value) {
+    criterion.any = value == "*" || value == "*-*";
+    if (criterion.any) return nullptr;
+    if constexpr (F::kind == FieldKind::Text) {
+        if (!value.empty() && value[0] == '~') { // info=~олимпиад, info=~олимп*: слово текста (регистр не важен)
+            criterion.word = true;
+            criterion.prefix = value.back() == '*';
+            if (!appendWide(criterion.from, value.substr(1, value.size() - 1 - criterion.prefix))) return L"некорректная строка UTF-8";
+            if (criterion.from.empty() || !std::all_of(criterion.from.begin(), criterion.from.end(), isWordChar))
+                return L"ожидалось слово из букв и цифр (~слово или ~начало*)";
+            for (wchar_t& c : criterion.from) c = foldChar(c);
+            return nullptr;
+        }
+    }
+    size_t dashPos = F::kind == FieldKind::Text ? std::string_view::npos : value.find('-'); // в тексте дефис — часть маски
+    criterion.range = dashPos != std::string_view::npos;
+    std::string_view startStr = criterion.range ? value.substr(0, dashPos) : value;
+    std::string_view endStr = criterion.range ? value.substr(dashPos + 1) : value;
+    criterion.fromAny = startStr == "*";
+    criterion.toAny = endStr == "*";
+    if constexpr (F::kind == FieldKind::Int) { // id=1, group=101-103, group=*-105, group=104-*
+        int lo = std::numeric_limits<int>::min(), hi = std::numeric_limits<int>::max();
+        if ((!criterion.fromAny && !parseNumber(startStr, lo)) || (!criterion.toAny && !parseNumber(endStr, hi)))
+            return L"некорректное число";
+        criterion.lo = lo;
+        criterion.hi = hi;
+    }
+    else if constexpr (F::kind == FieldKind::Rating) { // rating=4, rating=3.5-4.5
+        int lo, hi;
+        if (!ratingBounds(value, lo, hi)) return L"некорректная оценка";
+        criterion.lo = lo;
+        criterion.hi = hi;
+    }
+    else { // name="Кузьмин *", name=Ку*-Пе*, name=*Иван*
+        if (!appendWide(criterion.from, startStr) || !appendWide(criterion.to, endStr)) return L"некорректная строка UTF-8";
+    }
+    return nullptr;
+}
+template <typename F>
+bool Database::testField(const Criterion& criterion, const Student& student) {
+    const auto& value = student.*F::member;
+    if constexpr (F::kind == FieldKind::Int || F::kind == FieldKind::Rating)
+        return value >= criterion.lo && value <= criterion.hi;
+    else {
+        const wchar_t* text = textOf(value);
+        if (criterion.word) return hasWord(text, criterion.from, criterion.prefix);
+        if (!criterion.range) return maskMatch(text, criterion.from.c_str());
+        return (criterion.fromAny || compareBound(text, criterion.from) >= 0) &&
+               (criterion.toAny || compareBound(text, criterion.to) <= 0);
+    }
+}
+template <typename F>
+void Database::formatField(std::string& line, const Student& student) {
+    const auto& value = student.*F::member;
+    if constexpr (F::kind == FieldKind::Int) {
+        char buf[16];
+        line.append(buf, std::to_chars(buf, buf + sizeof(buf), value).ptr);
+    }
+    else if constexpr (F::kind == FieldKind::Rating) appendRating(line, value);
+    else if constexpr (F::kind == FieldKind::Name) appendUtf8(line, value, wcslen(value));
+    else appendUtf8(line, value.data(), value.size());
+}
+template <typename F>
+bool Database::equalField(const Student& a, const Student& b) {
+    if constexpr (F::kind == FieldKind::Name) return wcscmp(a.*F::member, b.*F::member) == 0;
+    else return a.*F::member == b.*F::member;
+}
+template <typename F>
+bool Database::parseField(Student& to, std::string_view value) {
+    if constexpr (F::kind == FieldKind::Int || F::kind == FieldKind::Rating) {
+        std::conditional_t<F::kind == FieldKind::Int, int, double> number;
+        if (!parseNumber(value, number) || !F::valid(number)) {
+            std::wcout << F::invalid;
+            return false;
+        }
+        if constexpr (F::kind == FieldKind::Int) to.*F::member = number;
+        else to.*F::member = toRating10(number);
+    }
+    else {
+        std::wstring text;
+        if (!appendWide(text, value) || !F::valid(text)) {
+            std::wcout << F::invalid;
+            return false;
+        }
+        if constexpr (F::kind == FieldKind::Name) {
+            wcsncpy(to.*F::member, text.c_str(), 63);
+            (to.*F::member)[63] = L'\0';
+        }
+        else to.*F::member = std::move(text);
+    }
+    return true;
+}
+template <typename F>
+void Database::copyField(Student& to, const Student& from) {
+    if constexpr (F::kind == FieldKind::Name) wcscpy(to.*F::member, from.*F::member);
+    else to.*F::member = from.*F::member;
+}
+template <typename F>
+void Database::sortField(const std::vector<Student>& students, RowList& rows, size_t parallelThreshold) {
+    const RequestControl* control = RequestControl::current(); // сортировка для print — её можно прервать
+    if constexpr (F::kind == FieldKind::Int) // radix-сортировка по ключу (стабильно, порядок выборки сохраняется при равенстве)
+        sortRowsByKey(rows, parallelThreshold, [&](size_t i) { return groupKey(students[i].*F::member); }, nullptr, control);
+    else if constexpr (F::kind == FieldKind::Name)
+        sortRowsByKey(rows, parallelThreshold, [&](size_t i) { return namePrefixKey(students[i].*F::member); },
+                      [&](size_t a, size_t b) { return wcscmp(students[a].*F::member, students[b].*F::member) < 0; }, control);
+    else if constexpr (F::kind == FieldKind::Rating) { // Сортировка подсчётом по 31 значению оценки, O(n)
+        std::array<size_t, ratingMax - ratingMin + 2> start{};
+        for (size_t i : rows) ++start[students[i].*F::member - ratingMin + 1];
+        for (size_t r = 1; r < start.size(); ++r) start[r] += start[r - 1];
+        RowList sorted(rows.size(), rows.get_allocator());
+        for (size_t i : rows) sorted[start[students[i].*F::member - ratingMin]++] = i;
+        rows.swap(sorted);
+    }
+    else // текст: ключ из первых символов, как у ФИО, равные ключи досортировываются сравнением строк
+        sortRowsByKey(rows, parallelThreshold, [&](size_t i) { return namePrefixKey((students[i].*F::member).c_str()); },
+                      [&](size_t a, size_t b) { return students[a].*F::member < students[b].*F::member; }, control);
+}
+template <typename... F>
+std::array<Database::FieldOps, sizeof...(F)> Database::makeFieldOps(const std::tuple<F...>*) {
+    return { FieldOps{ F::name, F::index, F::editable, &compileField<F>, &testField<F>, &formatField<F>,
+                       &equalField<F>, &parseField<F>, &copyField<F>, &sortField<F> }... };
+}
+const std::array<Database::FieldOps, Database::FieldCount> Database::fieldOps = Database::makeFieldOps((const Schema*)nullptr);
+int Database::fieldNumber(std::string_view name) {
+    for (int field = 0; field < FieldCount; ++field)
+        if (name == fieldOps[field].name) return field;
+    return -1;
+}
+
+// Перестроение всех индексов (отсортированные массивы, корзины оценки, массив id) и сброс выборки на все записи
+void Database::rebuildIndexes() {
+    waitIndexBuilder();
+    selectedStudents.clear();
+    selectedStudents.reserve(students.size());
+    selectedStudents.resize(students.size());
+    for (size_t i = 0; i < students.size(); ++i)
+        selectedStudents[i] = i;
+    std::vector<IndexKind> deferred;
+    for (int k = 0; k < IndexCount; ++k) {
+        indexReady[k] = false;
+        if (eagerIndexes[k]) {
+            buildIndex((IndexKind)k);
+            indexReady[k] = true;
+        }
+        else deferred.push_back((IndexKind)k);
+    }
+    // Остальные строим в фоне: open и изменения их не ждут, а запросы до готовности идут сканированием
+    if (backgroundIndexes && !deferred.empty())
+        indexBuilder = std::thread([this, deferred]() {
+            for (IndexKind kind : deferred) {
+                buildIndex(kind);
+                indexReady[kind] = true;
             }
-            else {
-                if (std::to_wstring(group) != value) {
-                    return false;
-                }
+        });
+}
+// Перестроение индексов, устаревших в транзакции, с сохранением выборки
+void Database::refreshIndexes() {
+    if (!indexesDirty) return;
+    std::vector<size_t> selection = std::move(selectedStudents);
+    rebuildIndexes();
+    selectedStudents = std::move(selection);
+    indexesDirty = false;
+}
+// Беззнаковое число в varint: по 7 бит в байте, старший бит — продолжение
+static void appendVarint(std::vector<uint8_t>& out, size_t value) {
+    for (; value >= 0x80; value >>= 7) out.push_back(uint8_t(value | 0x80));
+    out.push_back(uint8_t(value));
+}
+static size_t readVarint(const uint8_t*& p) {
+    size_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *p++;
+        value |= size_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+}
+// Построение одного индекса по текущим записям
+void Database::buildIndex(IndexKind kind) {
+    if (kind == IndexInfo) {
+        // Списки слов собираются одним проходом по записям (номера сразу по возрастанию), потом слова сортируются
+        struct Postings {
+            std::vector<uint8_t> bytes;
+            size_t last = 0, count = 0;
+        };
+        std::unordered_map<std::wstring, Postings> words;
+        std::wstring word;
+        for (size_t i = 0; i < students.size(); ++i)
+            for (const wchar_t* text = students[i].info.c_str(); *text;) {
+                while (*text && !isWordChar(*text)) ++text;
+                word.clear();
+                for (; isWordChar(*text); ++text) word += foldChar(*text);
+                if (word.empty()) continue;
+                Postings& list = words[word];
+                if (list.count && list.last == i) continue; // слово повторяется в той же записи
+                appendVarint(list.bytes, i - list.last);
+                list.last = i;
+                ++list.count;
             }
+        infoWords.clear();
+        infoWords.reserve(words.size());
+        for (const auto& entry : words) infoWords.push_back(entry.first);
+        std::sort(infoWords.begin(), infoWords.end());
+        infoWordStart.assign(1, 0);
+        infoWordBytes.clear();
+        infoPostings.clear();
+        for (const auto& w : infoWords) {
+            const Postings& list = words[w];
+            infoWordBytes.push_back(infoPostings.size());
+            infoPostings.insert(infoPostings.end(), list.bytes.begin(), list.bytes.end());
+            infoWordStart.push_back(infoWordStart.back() + list.count);
         }
-        else if (field == L"rating") {
-            double rating = student.rating;
-            size_t dashPos = value.find(L'-');
-            if (dashPos != std::string::npos) {
-                std::wstring startStr = value.substr(0, dashPos);
-                std::wstring endStr = value.substr(dashPos + 1);
-                double start = startStr == L"*" ? -std::numeric_limits<double>::max() : std::stod(startStr);
-                double end = endStr == L"*" ? std::numeric_limits<double>::max() : std::stod(endStr);
-                if (rating < start || rating > end) {
-                    return false;
-                }
+        infoPostings.shrink_to_fit();
+        return;
+    }
+    // Номера записей и буферы сортировки размером с таблицу — из кучи: арена запроса отдала бы их только после запроса
+    RowList rows(students.size());
+    for (size_t i = 0; i < rows.size(); ++i) rows[i] = i;
+    // Массивы индексов сортируем radix-сортировкой; при равном значении поля порядок по номеру записи, как в компараторах
+    auto build = [&](std::vector<Index>& index, const std::function<uint64_t(size_t)>& key,
+                     const std::function<bool(size_t, size_t)>& tieLess) {
+        sortRowsByKey(rows, parallelThreshold, key, tieLess);
+        index.resize(rows.size());
+        for (size_t k = 0; k < rows.size(); ++k) index[k] = Index{ rows[k] };
+    };
+    if (kind == IndexName)
+        build(studentsBN, [&](size_t i) { return namePrefixKey(students[i].name); },
+              [&](size_t a, size_t b) { return wcscmp(students[a].name, students[b].name) < 0; });
+    else if (kind == IndexGroup)
+        build(studentsBG, [&](size_t i) { return groupKey(students[i].group); }, nullptr);
+    else if (kind == IndexRating) {
+        for (auto& bucket : studentsBR) bucket.clear();
+        for (size_t i = 0; i < students.size(); ++i)
+            studentsBR[students[i].rating10 - ratingMin].push_back(i);
+        for (size_t r = 0; r < studentsBR.size(); ++r)
+            ratingStart[r + 1] = ratingStart[r] + studentsBR[r].size();
+    }
+    else {
+        build(studentsBI, [&](size_t i) { return groupKey(students[i].id); }, nullptr);
+        // id почти всегда плотные (1..nextId), поэтому прямой массив дешевле хеш-таблицы.
+        // Если id сильно разрежены (импорт чужих файлов), массив не строим и ищем двоичным поиском в studentsBI
+        int maxId = 0;
+        for (const auto& student : students) maxId = std::max(maxId, student.id);
+        studentsById.clear();
+        if ((size_t)maxId <= students.size() * 4 + 1024) {
+            studentsById.assign((size_t)maxId + 1, students.size());
+            for (size_t i = 0; i < students.size(); ++i)
+                if (students[i].id >= 0) studentsById[(size_t)students[i].id] = i;
+        }
+    }
+}
+// Дождаться фонового построения индексов
+void Database::waitIndexBuilder() {
+    if (indexBuilder.joinable()) indexBuilder.join();
+}
+// Построить индекс сейчас, если он ещё не готов
+void Database::ensureIndex(IndexKind kind) {
+    if (indexReady[kind]) return;
+    waitIndexBuilder(); // фоновый поток, возможно, как раз его строит
+    if (!indexReady[kind]) {
+        buildIndex(kind);
+        indexReady[kind] = true;
+    }
+}
+Database::~Database() {
+    waitIndexBuilder();
+    registerFile("", 0, 0);
+}
+std::array<bool, Database::IndexCount> Database::eagerIndexes = { true, true, true, true, true };
+bool Database::backgroundIndexes = true;
+// Какие индексы строить сразу
+Database::FileRegistry& Database::registry() {
+    static FileRegistry* reg = new FileRegistry(); // не разрушается при выходе: поток слежения может ещё работать
+    return *reg;
+}
+void Database::setCacheBudget(size_t bytes) {
+    FileRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.budget = bytes;
+    trimCache(reg);
+}
+void Database::registerFile(const std::string& path, size_t records, size_t bytes) {
+    FileRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    if (!registeredPath.empty()) {
+        OpenFile& old = reg.files[registeredPath];
+        --old.sessions;
+        old.lastUse = ++reg.clock;
+        if (syncedGeneration != old.generation && old.unsynced && --old.unsynced == 0) old.latest.reset();
+    }
+    registeredPath = path;
+    if (!path.empty()) {
+        OpenFile& entry = reg.files[path];
+        ++entry.sessions;
+        entry.records = records;
+        entry.tableBytes = bytes;
+        entry.lastUse = ++reg.clock;
+        syncedGeneration = entry.generation; // только что прочитан — изменения извне уже учтены
+        // Следим за каталогом, а не за файлом: сохранение подменяет файл через rename
+        if (reg.watching && reg.inotifyFd >= 0) {
+            size_t slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+            int wd = inotify_add_watch(reg.inotifyFd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (wd >= 0) reg.watchedDirs[wd] = dir;
+        }
+    }
+    trimCache(reg);
+}
+void Database::trimCache(FileRegistry& reg, size_t incoming) {
+    while (reg.cachedBytes + incoming > reg.budget) {
+        // Самый давно использованный файл, который никто не держит открытым
+        auto victim = reg.files.end();
+        for (auto it = reg.files.begin(); it != reg.files.end(); ++it)
+            if (!it->second.sessions && it->second.cached &&
+                (victim == reg.files.end() || it->second.lastUse < victim->second.lastUse))
+                victim = it;
+        if (victim == reg.files.end()) break;
+        reg.cachedBytes -= victim->second.cached->bytes;
+        victim->second.cached.reset();
+        ++reg.evictions;
+    }
+    // Файлы без сеансов и без записей в кэше из реестра убираем
+    for (auto it = reg.files.begin(); it != reg.files.end();)
+        it = !it->second.sessions && !it->second.cached ? reg.files.erase(it) : std::next(it);
+}
+size_t Database::tableBytes(const std::vector<Student>& students, const std::vector<off_t>& lineOffsets) {
+    size_t bytes = students.size() * sizeof(Student) + lineOffsets.size() * sizeof(off_t);
+    const size_t inlineCapacity = std::wstring().capacity(); // короткая информация хранится внутри Student
+    for (const Student& student : students)
+        if (student.info.capacity() > inlineCapacity) bytes += (student.info.capacity() + 1) * sizeof(wchar_t);
+    return bytes;
+}
+void Database::printMemory() {
+    FileRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    auto mib = [](size_t bytes) {
+        std::wostringstream out;
+        out << std::fixed << std::setprecision(1) << bytes / 1048576.0 << L" МиБ";
+        return out.str();
+    };
+    if (reg.files.empty()) std::wcout << L"Открытых файлов нет\n";
+    for (const auto& [path, entry] : reg.files) {
+        std::wcout << utf8_to_utf16(path) << L": записей " << entry.records << L", сеансов " << entry.sessions
+                   << L", на сеанс ~" << mib(entry.tableBytes) << L", всего ~" << mib(entry.tableBytes * entry.sessions)
+                   << L", в кэше " << (entry.cached ? mib(entry.cached->bytes) : L"нет") << L"\n";
+    }
+    std::wcout << L"Кэш: " << mib(reg.cachedBytes) << L" из " << mib(reg.budget) << L", попаданий " << reg.hits
+               << L", промахов " << reg.misses << L", вытеснено " << reg.evictions << L"\n";
+    RequestArena::Stats arena = RequestArena::stats();
+    std::wostringstream average;
+    average << std::fixed << std::setprecision(1) << (arena.requests ? arena.bytes / 1024.0 / arena.requests : 0.0) << L" КиБ";
+    std::wcout << L"Арены запросов: запросов " << arena.requests << L", в среднем " << average.str()
+               << L" на запрос, максимум " << mib(arena.peakBytes) << L", блоков из кучи сверх начального "
+               << arena.heapBlocks << L" (" << mib(arena.heapBytes) << L")\n";
+}
+// -------------------------------------------------- Слежение за файлами --------------------------------------------------
+Database::ExternalChangeCallback Database::externalChangeCallback;
+std::atomic<uint64_t> Database::instanceCount{ 0 };
+void Database::onExternalChange(ExternalChangeCallback callback) {
+    externalChangeCallback = std::move(callback);
+}
+void Database::setWatching(bool enabled) {
+    FileRegistry& reg = registry();
+    std::lock_guard<std::mutex> lock(reg.mutex);
+    reg.watching = enabled;
+    if (enabled && reg.inotifyFd < 0) {
+        reg.inotifyFd = inotify_init1(IN_CLOEXEC);
+        if (reg.inotifyFd >= 0) std::thread(watchLoop).detach();
+        else reg.watching = false;
+    }
+}
+void Database::watchLoop() {
+    FileRegistry& reg = registry();
+    alignas(inotify_event) char buffer[16 * 1024];
+    while (true) {
+        ssize_t n = read(reg.inotifyFd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        // Несколько событий по одному файлу за одно чтение — перечитываем его один раз
+        std::set<std::string> changed;
+        {
+            std::lock_guard<std::mutex> lock(reg.mutex);
+            for (char* p = buffer; p < buffer + n;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                auto dir = reg.watchedDirs.find(event->wd);
+                if (!event->len || dir == reg.watchedDirs.end()) continue;
+                std::string path = dir->second == "/" ? "/" + std::string(event->name) : dir->second + "/" + event->name;
+                if (auto it = reg.files.find(path); it != reg.files.end() && it->second.sessions) changed.insert(path);
             }
-            else {
-                if (std::to_wstring(rating) != value) {
-                    return false;
-                }
+        }
+        for (const auto& path : changed) reloadChanged(path);
+    }
+}
+void Database::reloadChanged(const std::string& path) {
+    FileRegistry& reg = registry();
+    uint64_t writer = 0; // экземпляр процесса, чьё это сохранение (0 — запись извне)
+    FileStamp stamp;
+    if (!statFile(path, stamp)) return;
+    {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        auto it = reg.files.find(path);
+        if (it == reg.files.end() || !it->second.sessions) return;
+        OpenFile& entry = it->second;
+        // Сохранение экземпляра этого процесса: записавший и так совпадает с файлом, остальные его перечитывают
+        auto own = std::find_if(entry.ownWrites.begin(), entry.ownWrites.end(),
+                                [&](const OpenFile::OwnWrite& write) { return write.stamp == stamp; });
+        if (own != entry.ownWrites.end()) {
+            writer = own->writer;
+            entry.ownWrites.erase(entry.ownWrites.begin(), own + 1);
+        }
+        const CachedTable* known = entry.latest ? entry.latest.get() : entry.cached.get();
+        if (known && known->stamp == stamp) return;
+    }
+    // Файл записал другой процесс (или другой экземпляр): читаем его один раз для всех экземпляров
+    auto table = std::make_shared<CachedTable>();
+    try {
+        std::ifstream file(path);
+        if (!file.is_open()) return;
+        readTable(file, *table);
+    }
+    catch (const std::exception&) {
+        return; // файл ещё дописывают или он испорчен — дождёмся следующего события
+    }
+    FileStamp after;
+    if (!statFile(path, after) || !(after == stamp)) return; // файл меняли во время чтения — придёт следующее событие
+    table->stamp = stamp;
+    table->bytes = tableBytes(table->students, table->lineOffsets);
+    table->peerSave = writer != 0;
+    std::shared_ptr<const CachedTable> previous;
+    {
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        auto it = reg.files.find(path);
+        if (it == reg.files.end() || !it->second.sessions) return;
+        OpenFile& entry = it->second;
+        previous = entry.latest ? entry.latest : entry.cached;
+        ++entry.generation;
+        entry.latest = table;
+        entry.latestWriter = writer;
+        entry.unsynced = entry.sessions;
+        entry.records = table->students.size();
+        if (entry.cached) {
+            reg.cachedBytes -= entry.cached->bytes;
+            entry.cached.reset();
+        }
+        if (reg.budget) {
+            trimCache(reg, table->bytes);
+            if (reg.cachedBytes + table->bytes <= reg.budget) {
+                entry.cached = table;
+                reg.cachedBytes += table->bytes;
             }
         }
     }
+    // О своём сохранении клиентов оповестил записавший экземпляр
+    if (writer) return;
+    // Прежнее содержимое известно (кэш или прошлая перечитка) — рассылаем разницу, иначе просим перечитать всё
+    ChangeSet changes;
+    if (previous) changes = diffTables(*previous, *table);
+    else changes.reload = true;
+    if (externalChangeCallback) externalChangeCallback(path, changes);
+}
+bool Database::sameRecord(const Student& a, const Student& b) {
+    for (const FieldOps& field : fieldOps)
+        if (!field.equal(a, b)) return false;
+    return true;
+}
+Database::ChangeSet Database::diffTables(const CachedTable& before, const CachedTable& after) {
+    ChangeSet changes;
+    std::unordered_map<int, const Student*> old;
+    old.reserve(before.students.size());
+    for (const Student& student : before.students) old[student.id] = &student;
+    for (const Student& student : after.students) {
+        auto it = old.find(student.id);
+        if (it == old.end()) changes.inserted.push_back(student.id);
+        else if (!sameRecord(*it->second, student)) changes.updated.push_back(student.id);
+        if (it == old.end() || !sameRecord(*it->second, student)) changes.rows.push_back(formatLine(student));
+        if (it != old.end()) old.erase(it);
+    }
+    for (const auto& [id, student] : old) changes.deleted.push_back(id);
+    std::sort(changes.deleted.begin(), changes.deleted.end());
+    return changes;
+}
+// Перечитанное после записи извне (или сохранённое другим экземпляром) применяется разницей по id: изменённые записи
+// заменяются на месте, новые дописываются, пропавшие удаляются; затем одна сортировка и одно перестроение индексов,
+// файл не пишется
+void Database::syncWithFile() {
+    if (registeredPath.empty() || inTransaction) return; // в транзакции — после commit/rollback
+    std::shared_ptr<const CachedTable> table;
+    {
+        FileRegistry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        auto it = reg.files.find(registeredPath);
+        if (it == reg.files.end() || it->second.generation == syncedGeneration) return;
+        OpenFile& entry = it->second;
+        if (entry.latestWriter != instanceId) table = entry.latest; // своё сохранение применять нечего
+        syncedGeneration = entry.generation;
+        if (entry.unsynced && --entry.unsynced == 0) entry.latest.reset();
+    }
+    if (!table) return;
+    waitIndexBuilder();
+    std::unordered_map<int, size_t> rowById;
+    rowById.reserve(students.size());
+    for (size_t i = 0; i < students.size(); ++i) rowById[students[i].id] = i;
+    size_t oldSize = students.size(), inserted = 0, updated = 0, deleted = 0;
+    std::vector<char> keep(oldSize, 0);
+    for (const Student& student : table->students) {
+        auto it = rowById.find(student.id);
+        if (it == rowById.end()) {
+            students.push_back(student);
+            ++inserted;
+            continue;
+        }
+        keep[it->second] = 1;
+        if (!sameRecord(students[it->second], student)) {
+            students[it->second] = student;
+            ++updated;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < students.size(); ++i) {
+        if (i < oldSize && !keep[i]) {
+            ++deleted;
+            continue;
+        }
+        if (kept != i) students[kept] = std::move(students[i]);
+        ++kept;
+    }
+    students.resize(kept);
+    if (table->nextId > nextId) nextId = table->nextId;
+    if (inserted || updated || deleted) {
+        sort();
+        rebuildIndexes();
+        if (!table->peerSave) // о сохранении другого сеанса клиент узнаёт из оповещения
+            std::wcout << L"Файл изменён извне, записи обновлены: добавлено " << inserted << L", изменено " << updated
+                       << L", удалено " << deleted << L"\n";
+    }
+    // Порядок записей совпал с файлом — print снова можно отдавать прямо из файла
+    bool sameOrder = table->canonical && students.size() == table->students.size();
+    for (size_t i = 0; sameOrder && i < students.size(); ++i) sameOrder = students[i].id == table->students[i].id;
+    fileCanonical = sameOrder;
+    if (sameOrder) lineOffsets = table->lineOffsets;
+    std::lock_guard<std::mutex> lock(saveState->mutex);
+    saveState->stamp = table->stamp;
+    saveState->stampValid = sameOrder && saveState->pending == 0 && !(table->stamp == FileStamp{});
+}
+void Database::setIndexing(const std::string& eager, bool background) {
+    backgroundIndexes = background;
+    eagerIndexes.fill(eager == "all");
+    std::istringstream iss(eager);
+    std::string field;
+    while (std::getline(iss, field, ',')) {
+        field.erase(0, field.find_first_not_of(" \t"));
+        field.erase(field.find_last_not_of(" \t") + 1);
+        if (int number = fieldNumber(field); number >= 0 && fieldOps[number].index >= 0)
+            eagerIndexes[fieldOps[number].index] = true;
+    }
+}
+// Завершение изменения: сортировка, индексы и запись файла (в транзакции откладываются до commit)
+void Database::applyChanges(bool resort) {
+    if (inTransaction) {
+        // Номера записей не сдвигаются до commit (кроме удаления), поэтому выборку просто сбрасываем на все записи;
+        // если она и так была всеми записями подряд (add за add), только дописываем новые
+        indexesDirty = true;
+        size_t from = !selectedStudents.empty() && selectedStudents.back() + 1 == selectedStudents.size() &&
+                      selectedStudents.size() <= students.size() ? selectedStudents.size() : 0;
+        selectedStudents.resize(students.size());
+        for (size_t i = from; i < students.size(); ++i) selectedStudents[i] = i;
+        return;
+    }
+    if (resort) sort();
+    rebuildIndexes();
+    saveToFile(dbFile);
+}
+// Поиск записи по id через прямой массив (students.size(), если записи нет)
+size_t Database::findById(int id) const {
+    if (!indexReady[IndexId]) { // Индекс ещё строится — ищем сканированием
+        for (size_t i = 0; i < students.size(); ++i)
+            if (students[i].id == id) return i;
+        return students.size();
+    }
+    if (!studentsById.empty()) {
+        if (id < 0 || (size_t)id >= studentsById.size()) return students.size();
+        return studentsById[(size_t)id];
+    }
+    auto it = std::lower_bound(studentsBI.begin(), studentsBI.end(), id, CompareById{ &students });
+    return it == studentsBI.end() || students[(size_t)*it].id != id ? students.size() : (size_t)*it;
+}
+// Диапазон позиций [lo, hi) в порядке индекса поля для значения критерия
+bool Database::indexRange(const Criterion& criterion, size_t& lo, size_t& hi) const {
+    if (!indexedCriterion(criterion)) return false;
+    const Criterion& c = criterion;
+    if (c.index == IndexId) { // id=1, id=1-100, id=*-100, id=1-*
+        CompareById cmp{ &students };
+        lo = c.fromAny ? 0 : std::lower_bound(studentsBI.begin(), studentsBI.end(), (int)c.lo, cmp) - studentsBI.begin();
+        hi = c.toAny ? students.size() : std::upper_bound(studentsBI.begin(), studentsBI.end(), (int)c.hi, cmp) - studentsBI.begin();
+    }
+    else if (c.index == IndexName) { // name="Кузьмин *", name=Ку*-Пе*, name="Кузьмин Иван Иванович"
+        CompareByName cmp{ &students };
+        lo = c.fromAny ? 0 : std::equal_range(studentsBN.begin(), studentsBN.end(), c.from.c_str(), cmp).first - studentsBN.begin();
+        hi = c.toAny ? students.size() : std::equal_range(studentsBN.begin(), studentsBN.end(), c.to.c_str(), cmp).second - studentsBN.begin();
+    }
+    else if (c.index == IndexGroup) { // group=101, group=101-103, group=*-105, group=104-*
+        CompareByGroup cmp{ &students };
+        lo = c.fromAny ? 0 : std::equal_range(studentsBG.begin(), studentsBG.end(), (int)c.lo, cmp).first - studentsBG.begin();
+        hi = c.toAny ? students.size() : std::equal_range(studentsBG.begin(), studentsBG.end(), (int)c.hi, cmp).second - studentsBG.begin();
+    }
+    else if (c.index == IndexInfo) { // info=~слово — список одного слова, info=~нача* — списки подряд идущих слов словаря
+        auto first = std::lower_bound(infoWords.begin(), infoWords.end(), c.from);
+        auto last = c.prefix ? std::partition_point(first, infoWords.end(), [&](const std::wstring& w) { return w.compare(0, c.from.size(), c.from) == 0; })
+                             : first + (first != infoWords.end() && *first == c.from);
+        lo = infoWordStart[first - infoWords.begin()];
+        hi = infoWordStart[last - infoWords.begin()];
+    }
+    else { // Диапазон корзин (rating=4, rating=3-5, ...)
+        int loR = (int)std::max<long long>(c.lo, ratingMin);
+        int hiR = (int)std::min<long long>(c.hi, ratingMax);
+        lo = hi = 0;
+        if (loR <= hiR) {
+            lo = ratingStart[loR - ratingMin];
+            hi = ratingStart[hiR - ratingMin + 1];
+        }
+    }
+    if (lo > hi) hi = lo; // Начало диапазона позже конца — ничего не подходит
+    return true;
+}
+// Ограничивает ли критерий выборку по индексу
+bool Database::indexedCriterion(const Criterion& criterion) {
+    if (criterion.any || criterion.index < 0) return false;
+    if (criterion.index == IndexInfo) return criterion.word; // маски info проверяются по записям
+    if (criterion.index == IndexName) {
+        auto innerStar = [](const std::wstring& mask) {
+            size_t starPos = mask.find(L'*');
+            return starPos != std::wstring::npos && starPos != mask.length() - 1;
+        };
+        return !innerStar(criterion.from) && !innerStar(criterion.to);
+    }
     return true;
 }
+// Номер записи на позиции pos в порядке индекса
+size_t Database::indexRow(int kind, size_t pos) const {
+    if (kind == IndexId) return (size_t)studentsBI[pos];
+    if (kind == IndexName) return (size_t)studentsBN[pos];
+    if (kind == IndexGroup) return (size_t)studentsBG[pos];
+    size_t bucket = std::upper_bound(ratingStart.begin(), ratingStart.end(), pos) - ratingStart.begin() - 1;
+    return studentsBR[bucket][pos - ratingStart[bucket]];
+}
+
+// Фильтрация кандидатов по критериям с сохранением порядка
+size_t Database::parallelThreshold = 100000;
+template <typename Rows, typename Matches>
+Database::RowList Database::filterRows(const Rows& rows, const Matches& matches) const {
+    TraceSpan span("filter");
+    RowList result(RequestArena::current());
+    ThreadPool& pool = ThreadPool::instance();
+    // Морсели фиксированного размера; между ними — проверка отмены и срока запроса
+    const size_t morsel = 16384;
+    if (rows.size() < parallelThreshold || pool.size() == 1) {
+        for (size_t k = 0; k < rows.size(); ++k) {
+            if (k % morsel == 0) RequestControl::checkpoint();
+            if (matches(rows[k])) result.push_back(rows[k]);
+        }
+        return result;
+    }
+    // Каждый поток пишет в свой кусок (из обычной кучи: арена только у вызывающего потока), затем склеиваем по порядку.
+    // У рабочих потоков пула нет текущего запроса — объект отмены передаём явно
+    const RequestControl* control = RequestControl::current();
+    std::vector<std::vector<size_t>> parts((rows.size() + morsel - 1) / morsel);
+    pool.parallelFor(parts.size(), [&](size_t m) {
+        if (control) control->check();
+        size_t to = std::min(rows.size(), (m + 1) * morsel);
+        for (size_t k = m * morsel; k < to; ++k)
+            if (matches(rows[k])) parts[m].push_back(rows[k]);
+    });
+    size_t total = 0;
+    for (const auto& part : parts) total += part.size();
+    result.reserve(total);
+    for (const auto& part : parts) result.insert(result.end(), part.begin(), part.end());
+    return result;
+}
+// Настройка параллельного выполнения
+void Database::setParallelism(size_t threshold, size_t threads) {
+    parallelThreshold = threshold;
+    ThreadPool::configure(threads);
+}
 
 // -------------------------------------------------- Внешние методы работы с БД --------------------------------------------------
 // Выполнение команды из строки
-void Database::parseCommand(const std::wstring& full_command) {
-    std::wstring command;
-    std::wstring args;
-    if (size_t space = full_command.find(L" "); space == std::string::npos) {
-        command = full_command;
-        args = L"";
-        if (command == L"open" ||
-            command == L"add" ||
-            command == L"update") {
-            std::wcout << "Не удалось обработать команду\n";
-            return;
+bool Database::parseCommand(std::string_view full_command) {
+    std::string_view command = full_command;
+    std::string_view args;
+    if (size_t space = full_command.find(' '); space == std::string_view::npos) {
+        if (command == "open" ||
+            command == "add" ||
+            command == "update") {
+            std::wcout << L"Не удалось обработать команду\n";
+            return false;
         }
     }
     else {
         command = full_command.substr(0, space);
-        args = full_command.substr(space + 1, full_command.length() - space - 1);
+        args = full_command.substr(space + 1);
+    }
+    // Аргументы open, save и add нужны строкой в памяти (UTF-16), остальные команды разбирают байты команды сами
+    std::wstring wargs;
+    if ((command == "open" || command == "save" || command == "add") && !appendWide(wargs, args)) {
+        std::wcout << L"Ошибка: некорректная строка UTF-8\n";
+        return false;
+    }
+    // Файл мог записать другой процесс: сначала применяем его изменения
+    syncWithFile();
+    // В транзакции индексы перестраиваются не после каждого изменения, а перед первым чтением
+    if (command == "select" || command == "print" || command == "count" || command == "page")
+        refreshIndexes();
+    if (command == "open") {
+        return selectDB(wargs);
     }
-    if (command == L"open") {
-        selectDB(args);
+    else if (command == "save") {
+        return saveDB(wargs);
     }
-    else if (command == L"save") {
-        saveDB();
+    else if (command == "begin") {
+        return begin();
     }
-    else if (command == L"select") {
-        select(args);
+    else if (command == "commit") {
+        return commit();
     }
-    else if (command == L"reselect") {
-        reselect(args);
+    else if (command == "rollback") {
+        return rollback();
     }
-    else if (command == L"print") {
+    else if (command == "select") {
+        return select(args);
+    }
+    else if (command == "reselect") {
+        return reselect(args);
+    }
+    else if (command == "print") {
         print(args);
+        return true;
     }
-    else if (command == L"add") {
-        add(args);
+    else if (command == "count") {
+        return count(args);
     }
-    else if (command == L"remove") {
-        remove();
+    else if (command == "page") {
+        return page(args);
     }
-    else if (command == L"update") {
-        update(args);
+    else if (command == "memory") {
+        printMemory();
+        return true;
     }
-    else {
-        std::wcout << L"Не удалось обработать команду\n";
+    else if (command == "add") {
+        return add(wargs);
+    }
+    else if (command == "remove") {
+        return remove(args);
     }
+    else if (command == "update") {
+        return update(args);
+    }
+    std::wcout << L"Не удалось обработать команду\n";
+    return false;
 }
 // -------------------------------------------------- Работа с файлом БД --------------------------------------------------
 // Выбор файла базы данных
-void Database::selectDB(const std::wstring& filename) {
+bool Database::selectDB(const std::wstring& filename) {
+    if (inTransaction) { // Новый файл — незавершённая транзакция старого отменяется
+        inTransaction = indexesDirty = false;
+        txnSnapshot.clear();
+        pendingChanges = ChangeSet{};
+        std::wcout << L"Транзакция отменена\n";
+    }
     dbFile = filename;
-    loadFromFile(dbFile);
+    bool loaded = loadFromFile(dbFile);
     notifyChanged();
+    return loaded;
 }
 // Сохранение базы данных
-void Database::saveDB() {
+bool Database::saveDB(const std::wstring& args) {
+    if (inTransaction) {
+        std::wcout << L"Ошибка: идёт транзакция, изменения сохраняются командой commit\n";
+        return false;
+    }
     saveToFile(dbFile);
-    std::wcout << L"База данных сохранена в " << dbFile << L"\n";
+    if (args != L"wait") {
+        std::wcout << L"База данных сохраняется в " << dbFile << L" (запись в фоне)\n";
+        return true;
+    }
+    if (waitSaved()) {
+        std::wcout << L"База данных сохранена в " << dbFile << L"\n";
+        return true;
+    }
+    std::wcout << L"Ошибка: не удалось сохранить файл " << dbFile << L"\n";
+    return false;
 }
 // -------------------------------------------------- Выборка из данных --------------------------------------------------
 // Выборка записей
-void Database::select(const std::wstring& command) {
-    auto criteria = parseCriteria(command);
-    if (criteria.empty()) {
-        selectedStudents.clear();
-        selectedStudents.reserve(students.size());
-        selectedStudents.resize(students.size());
-        for (size_t i = 0; i < students.size(); ++i) {
-            selectedStudents[i] = i;
+bool Database::select(std::string_view command) {
+    Criteria criteria;
+    if (!compileCriteria(command, criteria)) return false;
+    RowList rows = selectRows(criteria);
+    selectedStudents.assign(rows.begin(), rows.end()); // выборка живёт дольше запроса — копия из арены в свою память
+    std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после выборки\n";
+    return true;
+}
+// Множество номеров записей битами: объединение и вычитание больших множеств без сортировки,
+// номера читаются обратно по возрастанию за один проход по словам
+namespace {
+struct RowBits {
+    std::pmr::vector<uint64_t> words;
+    explicit RowBits(size_t rows) : words((rows + 63) / 64, 0, RequestArena::current()) {}
+    void set(size_t row) { words[row >> 6] |= uint64_t(1) << (row & 63); }
+    bool test(size_t row) const { return (words[row >> 6] >> (row & 63)) & 1; }
+    // Отмеченные (complement — неотмеченные) номера меньше rows по возрастанию
+    void appendTo(std::pmr::vector<size_t>& out, size_t rows, bool complement) const {
+        for (size_t w = 0; w < words.size(); ++w) {
+            uint64_t bits = complement ? ~words[w] : words[w];
+            if (w + 1 == words.size() && rows % 64) bits &= (uint64_t(1) << (rows % 64)) - 1;
+            for (; bits; bits &= bits - 1) out.push_back(w * 64 + (size_t)__builtin_ctzll(bits));
         }
-        std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после выборки\n";
-        return;
     }
-    selectedStudents.clear();
-
-    // --- Быстрый поиск по деревьям ---
-    std::set<Index>::iterator startN, endN, startG, endG, startR, endR; // Диапазоны валидных записей по деревьям
-    bool N{}, G{}, R{}; // Были ли найдены записи по этим деревьям
-    std::wstring id_criteria;
-    for (const auto& crit : criteria) {
-        const std::wstring& field = crit.first;
-        const std::wstring& value = crit.second;
-        if (field == L"id") {
-            id_criteria = value;
-        }
-        // --- Поиск по name ---
-        else if (field == L"name") {
-            if (value == L"*") continue;
-            size_t dashPos = value.find(L'-');
-            if (dashPos != std::string::npos) { // Если у нас поиск по диапазону значений (name=А*-Б*, ...)
-                std::wstring startStr = value.substr(0, dashPos);
-                std::wstring endStr = value.substr(dashPos + 1);
-                if (startStr > endStr)
-                    if (startStr == L"*" && endStr == L"*") continue;
-                if (size_t starPos = startStr.find(L"*"); starPos != std::string::npos && starPos != startStr.length() - 1) continue;
-                if (startStr == L"*") startN = studentsBN.begin();
-                else startN = studentsBN.equal_range(startStr.c_str()).first;
-                if (size_t starPos = endStr.find(L"*"); starPos != std::string::npos && starPos != endStr.length() - 1) continue;
-                if (endStr == L"*") endN = studentsBN.end();
-                else endN = studentsBN.equal_range(endStr.c_str()).second;
-            }
-            else { // Если у нас поиск по одному значению
-                if (size_t starPos = value.find(L"*"); starPos != std::string::npos && starPos != value.length() - 1) continue;
-                auto [f, s] = studentsBN.equal_range(value.c_str());
-                startN = f;
-                endN = s;
-            }
-            N = true;
-        }
-        // --- Поиск по group ---
-        else if (field == L"group") {
-            if (value == L"*") continue;
-            size_t dashPos = value.find(L'-');
-            if (dashPos != std::wstring::npos) { // Если у нас поиск по диапазону значений (group=101-105, ...)
-                std::wstring startStr = value.substr(0, dashPos);
-                std::wstring endStr = value.substr(dashPos + 1);
-                if (startStr == L"*" && endStr == L"*") continue;
-                if (startStr == L"*") startG = studentsBG.begin();
-                else startG = studentsBG.equal_range(std::stoi(startStr)).first;
-                if (endStr == L"*") endG = studentsBG.end();
-                else endG = studentsBG.equal_range(std::stoi(endStr)).second;
-            }
-            else { // Если у нас поиск по одному значению
-                auto [f, s] = studentsBG.equal_range(std::stoi(value));
-                startG = f;
-                endG = s;
-            }
-            G = true;
-        }
-        // --- Поиск по rating ---
-        else if (field == L"rating") {
-            if (value == L"*") continue;
-            size_t dashPos = value.find(L'-');
-            if (dashPos != std::string::npos) { // Если у нас поиск по диапазону значений (rating=3-5, ...)
-                std::wstring startStr = value.substr(0, dashPos);
-                std::wstring endStr = value.substr(dashPos + 1);
-                if (startStr == L"*" && endStr == L"*") continue;
-                if (startStr == L"*") startR = studentsBR.begin();
-                else startR = studentsBR.equal_range(std::stod(startStr)).first;
-                if (endStr == L"*") endR = studentsBR.end();
-                else endR = studentsBR.equal_range(std::stod(endStr)).second;
-            }
-            else { // Если у нас поиск по одному значению
-                auto [f, s] = studentsBR.equal_range(std::stod(value));
-                startR = f;
-                endR = s;
-            }
-            R = true;
+};
+}
+// Номера записей, подходящих под критерии: ветки or выбираются по отдельности и объединяются слиянием
+Database::RowList Database::selectRows(const Criteria& criteria) const {
+    RowList rows = selectBranch(criteria, 0);
+    for (size_t branch = 1; branch < criteria.branchCount && rows.size() < students.size(); ++branch) {
+        RequestControl::checkpoint();
+        RowList more = selectBranch(criteria, branch);
+        TraceSpan span("intersect");
+        RowList merged(RequestArena::current());
+        merged.reserve(rows.size() + more.size());
+        std::set_union(rows.begin(), rows.end(), more.begin(), more.end(), std::back_inserter(merged));
+        rows.swap(merged);
+    }
+    return rows;
+}
+// Номера записей одной ветки (по индексам, с пересечением диапазонов): списки значений — несколько диапазонов
+// одного индекса, not по индексу вычитается битовой картой, остальные условия проверяются на кандидатах
+Database::RowList Database::selectBranch(const Criteria& criteria, size_t branch) const {
+    std::pmr::memory_resource* arena = RequestArena::current();
+    RowList rows(arena);
+    // --- Быстрый поиск по индексам: диапазоны позиций в отсортированных массивах ---
+    struct Scan {
+        const Predicate* predicate;
+        size_t width; // сколько позиций индекса покрывают диапазоны всех значений
+    };
+    std::pmr::vector<Scan> found(arena);    // условия, которые сужают выборку по индексу
+    std::pmr::vector<Scan> excluded(arena); // not-условия по индексу: их записи вычитаются
+    std::pmr::vector<const Predicate*> residual(arena); // проверяются на кандидатах (маска с * в середине, поля без индекса,
+                                                        // индексы, которые ещё строятся)
+    const Criterion* idPoint = nullptr; // Точечный поиск по id (через прямой массив)
+    std::optional<TraceSpan> walk(std::in_place, "indexRange"); // разбор условий по индексам и построение кандидатов
+    for (size_t p = criteria.branchBegin(branch); p < criteria.branchEnd[branch]; ++p) {
+        const Predicate& predicate = criteria.predicates[p];
+        const Criterion* first = criteria.begin(predicate);
+        const Criterion* last = criteria.end(predicate);
+        if (std::any_of(first, last, [](const Criterion& c) { return c.any; })) {
+            if (predicate.negate) return rows; // not поле=* — не подходит ни одна запись
+            continue;
         }
+        if (!predicate.negate && predicate.count == 1 && first->index == IndexId && !first->range) {
+            idPoint = first;
+            continue;
+        }
+        bool indexed = first->index >= 0 && indexReady[first->index] &&
+                       std::all_of(first, last, [](const Criterion& c) { return indexedCriterion(c); });
+        size_t width = 0;
+        for (const Criterion* value = first; indexed && value != last; ++value) {
+            size_t lo = 0, hi = 0;
+            indexRange(*value, lo, hi);
+            width += hi - lo;
+        }
+        if (!indexed)
+            residual.push_back(&predicate);
+        else if (predicate.negate) {
+            if (width) excluded.push_back({ &predicate, width });
+        }
+        else if (width == 0)
+            return rows; // ни одно значение не встречается — ветка пуста
+        else
+            found.push_back({ &predicate, width });
     }
-    // --- Если нет критериев — выбрать всё ---
-    if (!N && !G && !R && id_criteria.empty()) {
-        selectedStudents.reserve(students.size());
-        selectedStudents.resize(students.size());
-        for (size_t i = 0; i < students.size(); ++i)
-            selectedStudents[i] = i;
-        std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после выборки\n";
-        return;
+    // --- Точечный поиск по id: O(1) через массив, остальные условия ветки проверяем на одной записи ---
+    if (idPoint) {
+        size_t row = findById((int)idPoint->lo);
+        if (row < students.size() && matchesBranch(students[row], criteria, branch)) rows.push_back(row);
+        return rows;
     }
-    // --- Собираем индексы из каждого диапазона ---
-    std::set<size_t> name_indices, group_indices, rating_indices;
-    if (N) {
-        for (auto it = startN; it != endN; ++it) {
-            if (it == studentsBN.end()) {
-                name_indices.clear();
-                break;
+    // Записи диапазона позиций [lo, hi) индекса kind
+    auto forEachRow = [&](int kind, size_t lo, size_t hi, auto&& fn) {
+        if (kind == IndexInfo) { // списки слов словаря целиком: разворачиваем разности
+            size_t word = std::upper_bound(infoWordStart.begin(), infoWordStart.end(), lo) - infoWordStart.begin() - 1;
+            for (; word + 1 < infoWordStart.size() && infoWordStart[word] < hi; ++word) {
+                const uint8_t* p = infoPostings.data() + infoWordBytes[word];
+                size_t row = 0;
+                for (size_t k = infoWordStart[word]; k < infoWordStart[word + 1]; ++k) fn(row += readVarint(p));
             }
-            name_indices.insert((size_t)*it);
+            return;
         }
-    }
-    if (G) {
-        for (auto it = startG; it != endG; ++it) {
-            if (it == studentsBG.end()) {
-                group_indices.clear();
-                break;
+        if (kind != IndexRating) {
+            for (size_t pos = lo; pos < hi; ++pos) fn(indexRow(kind, pos));
+            return;
+        }
+        while (lo < hi) { // по корзинам оценки, без поиска корзины на каждую позицию
+            size_t bucket = std::upper_bound(ratingStart.begin(), ratingStart.end(), lo) - ratingStart.begin() - 1;
+            size_t to = std::min(hi, ratingStart[bucket + 1]);
+            for (size_t pos = lo; pos < to; ++pos) fn(studentsBR[bucket][pos - ratingStart[bucket]]);
+            lo = to;
+        }
+    };
+    auto markRows = [&](RowBits& bits, const Predicate& predicate) {
+        for (const Criterion* value = criteria.begin(predicate); value != criteria.end(predicate); ++value) {
+            size_t lo = 0, hi = 0;
+            indexRange(*value, lo, hi);
+            forEachRow(value->index, lo, hi, [&](size_t row) { bits.set(row); });
+        }
+    };
+    auto collect = [&](int kind, size_t lo, size_t hi) {
+        RowList out(arena);
+        if (kind == IndexRating) { // Корзины оценки уже упорядочены, сливаем их по очереди
+            while (lo < hi) {
+                size_t bucket = std::upper_bound(ratingStart.begin(), ratingStart.end(), lo) - ratingStart.begin() - 1;
+                size_t to = std::min(hi, ratingStart[bucket + 1]);
+                size_t mid = out.size();
+                out.insert(out.end(), studentsBR[bucket].begin() + (lo - ratingStart[bucket]), studentsBR[bucket].begin() + (to - ratingStart[bucket]));
+                std::inplace_merge(out.begin(), out.begin() + mid, out.end());
+                lo = to;
             }
-            group_indices.insert((size_t)*it);
+            return out;
         }
-    }
-    if (R) {
-        for (auto it = startR; it != endR; ++it) {
-            if (it == studentsBR.end()) {
-                rating_indices.clear();
-                break;
+        out.reserve(hi - lo);
+        if (kind == IndexInfo) { // список одного слова уже упорядочен; списки слов одного начала склеиваем без повторов
+            forEachRow(kind, lo, hi, [&](size_t row) { out.push_back(row); });
+            if (!std::is_sorted(out.begin(), out.end())) {
+                std::sort(out.begin(), out.end());
+                out.erase(std::unique(out.begin(), out.end()), out.end());
             }
-            rating_indices.insert((size_t)*it);
+            return out;
         }
-    }
-    std::vector<size_t> temp_result;
-    // --- Находим пересечение всех непустых множеств ---
-    if (!name_indices.empty() && !group_indices.empty() && !rating_indices.empty()) {
-        std::set_intersection(name_indices.begin(), name_indices.end(), group_indices.begin(), group_indices.end(), std::back_inserter(temp_result));
-        std::set<size_t> temp_set(temp_result.begin(), temp_result.end());
-        temp_result.clear();
-        std::set_intersection(temp_set.begin(), temp_set.end(), rating_indices.begin(), rating_indices.end(), std::back_inserter(temp_result));
-    }
-    else if (!name_indices.empty() && !group_indices.empty()) {
-        std::set_intersection(name_indices.begin(), name_indices.end(), group_indices.begin(), group_indices.end(), std::back_inserter(temp_result));
-    }
-    else if (!name_indices.empty() && !rating_indices.empty()) {
-        std::set_intersection(name_indices.begin(), name_indices.end(), rating_indices.begin(), rating_indices.end(), std::back_inserter(temp_result));
-    }
-    else if (!group_indices.empty() && !rating_indices.empty()) {
-        std::set_intersection(group_indices.begin(), group_indices.end(), rating_indices.begin(), rating_indices.end(), std::back_inserter(temp_result));
-    }
-    else if (!name_indices.empty()) {
-        temp_result.assign(name_indices.begin(), name_indices.end());
-    }
-    else if (!group_indices.empty()) {
-        temp_result.assign(group_indices.begin(), group_indices.end());
-    }
-    else if (!rating_indices.empty()) {
-        temp_result.assign(rating_indices.begin(), rating_indices.end());
-    }
-    // --- Если был хотя бы один критерий по дереву, temp_result содержит кандидатов ---
-    // --- Если есть критерий по id — фильтруем temp_result по id, иначе просто копируем ---
-    if (!id_criteria.empty()) {
-        std::vector<size_t> id_filtered;
-        for (size_t idx : temp_result) {
-            std::map<std::wstring, std::wstring> id_map = { {L"id", id_criteria} };
-            if (matchesCriteria(students[idx], id_map)) id_filtered.push_back(idx);
+        for (size_t pos = lo; pos < hi; ++pos) out.push_back(indexRow(kind, pos));
+        std::sort(out.begin(), out.end());
+        return out;
+    };
+    // Записи условия по возрастанию: одно значение — один диапазон; список — объединение диапазонов
+    // (плотное — битовой картой, редкое — склейкой с сортировкой; диапазоны могут перекрываться)
+    auto rowsOf = [&](const Scan& scan) {
+        const Criterion* first = criteria.begin(*scan.predicate);
+        if (scan.predicate->count == 1) {
+            size_t lo = 0, hi = 0;
+            indexRange(*first, lo, hi);
+            return collect(first->index, lo, hi);
+        }
+        RowList out(arena);
+        if (scan.width >= students.size() / 64) {
+            RowBits bits(students.size());
+            markRows(bits, *scan.predicate);
+            out.reserve(scan.width);
+            bits.appendTo(out, students.size(), false);
+            return out;
+        }
+        out.reserve(scan.width);
+        for (const Criterion* value = first; value != criteria.end(*scan.predicate); ++value) {
+            size_t lo = 0, hi = 0;
+            indexRange(*value, lo, hi);
+            forEachRow(value->index, lo, hi, [&](size_t row) { out.push_back(row); });
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+        return out;
+    };
+    if (found.empty()) {
+        // --- Нет условий, сужающих по индексу, — все записи (кроме вычитаемых битовой картой not-условий) ---
+        if (excluded.empty()) {
+            rows.resize(students.size());
+            for (size_t i = 0; i < students.size(); ++i)
+                rows[i] = i;
+        }
+        else {
+            RowBits bits(students.size());
+            for (const Scan& scan : excluded) markRows(bits, *scan.predicate);
+            bits.appendTo(rows, students.size(), true);
+            excluded.clear();
         }
-        selectedStudents = id_filtered;
     }
     else {
-        selectedStudents.insert(selectedStudents.end(), temp_result.begin(), temp_result.end());
+        // --- Начинаем с самого узкого условия (его ширина известна сразу), остальные пересекаем с ним ---
+        std::sort(found.begin(), found.end(), [](const Scan& a, const Scan& b) { return a.width < b.width; });
+        rows = rowsOf(found[0]);
+        for (size_t k = 1; k < found.size() && !rows.empty(); ++k) {
+            RequestControl::checkpoint();
+            walk.emplace("indexRange");
+            RowList range = rowsOf(found[k]);
+            walk.reset();
+            TraceSpan span("intersect");
+            RowList next(arena);
+            next.reserve(std::min(rows.size(), range.size()));
+            std::set_intersection(rows.begin(), rows.end(), range.begin(), range.end(), std::back_inserter(next));
+            rows.swap(next);
+        }
     }
-    // --- Если не было критериев по деревьям, но был только id — ищем по id по всем студентам ---
-    if ((N || G || R) == false && !id_criteria.empty()) {
-        for (size_t i = 0; i < students.size(); ++i) {
-            std::map<std::wstring, std::wstring> id_map = { {L"id", id_criteria} };
-            if (matchesCriteria(students[i], id_map)) selectedStudents.push_back(i);
+    walk.reset();
+    // --- not-условия: широкие вычитаются битовой картой, а если кандидатов меньше, чем их записей, — проверка на кандидатах ---
+    if (!excluded.empty() && !rows.empty()) {
+        RequestControl::checkpoint();
+        TraceSpan span("intersect");
+        RowBits bits(students.size());
+        bool marked = false;
+        for (const Scan& scan : excluded) {
+            if (scan.width > rows.size()) residual.push_back(scan.predicate);
+            else markRows(bits, *scan.predicate), marked = true;
         }
+        if (marked) rows.erase(std::remove_if(rows.begin(), rows.end(), [&](size_t row) { return bits.test(row); }), rows.end());
     }
-    std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после выборки\n";
+    if (!residual.empty())
+        rows = filterRows(rows, [&](size_t row) {
+            for (const Predicate* predicate : residual)
+                if (!matchesPredicate(students[row], criteria, *predicate)) return false;
+            return true;
+        });
+    return rows;
 }
 // Повторная выборка
-void Database::reselect(const std::wstring& command) {
+bool Database::reselect(std::string_view command) {
     if (selectedStudents.empty()) {
         std::wcout << L"Нет выбранных записей для повторной выборки\n";
-        return;
+        return true;
     }
-    auto criteria = parseCriteria(command);
+    Criteria criteria;
+    if (!compileCriteria(command, criteria)) return false;
     if (criteria.empty()) {
         std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после повторной выборки\n";
+        return true;
+    }
+    RowList rows = filterRows(selectedStudents, [&](size_t row) { return matchesCriteria(students[row], criteria); });
+    selectedStudents.assign(rows.begin(), rows.end());
+    std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после повторной выборки\n";
+    return true;
+}
+// Диапазон вывода print ... range=начало-конец (нумерация с 1, границы обрезаются по числу записей)
+static void parsePrintRange(std::string_view fields, size_t count, size_t& range_start, size_t& range_end) {
+    range_start = 0;
+    range_end = count;
+    size_t range_pos = fields.find("range=");
+    if (range_pos == std::string_view::npos) return;
+    std::string_view value = fields.substr(range_pos + 6);
+    value = value.substr(0, value.find(' '));
+    size_t dash = value.find('-');
+    size_t start, end;
+    if (dash == std::string_view::npos || !parseNumber(value.substr(0, dash), start) || !parseNumber(value.substr(dash + 1), end))
         return;
+    range_start = std::min(start - 1, count); // range=0-... — пустой диапазон
+    range_end = std::min(end, count);
+}
+// Быстрый путь print без форматирования (отдача строк файла как есть)
+int Database::openRawPrint(std::string_view fields, off_t& offset, size_t& length) const {
+    // Выбраны все записи (выборка всегда упорядочена и без повторов, значит совпадает с порядком в файле)
+    if (inTransaction || !fileCanonical || selectedStudents.size() != students.size() || fields.find("sort") != std::string_view::npos)
+        return -1;
+    // Печатаются все поля: первое слово не название поля (например, пусто, all или range=...)
+    std::string_view rest = fields;
+    if (fieldNumber(next_word(rest)) >= 0)
+        return -1;
+    // Есть не применённые записи другого сеанса или внешней программы — печатает printInto, применив их
+    {
+        FileRegistry& reg = registry();
+        std::lock_guard<std::mutex> lock(reg.mutex);
+        if (auto it = reg.files.find(registeredPath); it != reg.files.end() && it->second.generation != syncedGeneration)
+            return -1;
     }
-    std::vector<size_t> temp;
-    for (size_t i = 0; i < selectedStudents.size(); ++i) {
-        if (matchesCriteria(students[selectedStudents[i]], criteria)) {
-            temp.push_back(selectedStudents[i]);
+    std::string path = utf16_to_utf8(dbFile);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    // Файл мог переписать другой сеанс или внешняя программа — проверяем по открытому дескриптору
+    FileStamp current, saved;
+    bool savedValid;
+    {
+        std::lock_guard<std::mutex> lock(saveState->mutex);
+        saved = saveState->stamp;
+        savedValid = saveState->stampValid && saveState->pending == 0;
+    }
+    if (!savedValid || !statFile(path, current, fd) || !(current == saved)) {
+        close(fd);
+        return -1;
+    }
+    size_t range_start, range_end;
+    parsePrintRange(fields, students.size(), range_start, range_end);
+    if (range_start > range_end) range_start = range_end;
+    offset = lineOffsets[range_start];
+    length = (size_t)(lineOffsets[range_end] - lineOffsets[range_start]);
+    return fd;
+}
+// Номера полей из начала списка print
+std::pmr::vector<int> Database::printFields(std::string_view fields) {
+    std::pmr::vector<int> numbers(RequestArena::current());
+    for (std::string_view field = next_word(fields); !field.empty(); field = next_word(fields)) {
+        int number = fieldNumber(field);
+        if (number < 0) break;
+        numbers.push_back(number);
+    }
+    return numbers;
+}
+// Строка записи по номерам полей в буфер UTF-8
+void Database::appendRow(std::string& out, const Student& student, const std::pmr::vector<int>& fields) {
+    if (fields.empty()) {
+        for (int field = 0; field < FieldCount; ++field) {
+            if (field) out += '\t';
+            fieldOps[field].format(out, student);
         }
     }
-    selectedStudents = temp;
-    std::wcout << L"Выбрано " << selectedStudents.size() << L" записей после повторной выборки\n";
+    for (int field : fields) {
+        fieldOps[field].format(out, student);
+        out += '\t';
+    }
+    out += '\n';
 }
 // Вывод выбранных записей
-void Database::print(const std::wstring& fields) const {
-    std::vector<size_t> output_students = selectedStudents;
-    std::wstring sort_value;
-    size_t sort_pos = fields.find(L"sort");
-    if (sort_pos != std::wstring::npos) {
-        sort_value = fields.substr(sort_pos + 4);
-        sort_value.erase(0, sort_value.find_first_not_of(L" "));
-        sort_value.erase(sort_value.find_last_not_of(L" ") + 1);
-    }
-    if (!sort_value.empty()) {
-        std::sort(output_students.begin(), output_students.end(), [&](size_t a, size_t b) {
-            if (sort_value == L"name")
-                return wcscmp(students[a].name, students[b].name) <= 0;
-            else if (sort_value == L"group")
-                return students[a].group < students[b].group;
-            else if (sort_value == L"rating")
-                return students[a].rating < students[b].rating;
-            else
-                return wcscmp(students[a].name, students[b].name) <= 0;
-            });
+void Database::print(std::string_view fields) const {
+    std::string out;
+    formatPrint(fields, out);
+    std::wcout << utf8_to_utf16(out);
+}
+void Database::printInto(std::string_view fields, std::string& out) {
+    syncWithFile();
+    refreshIndexes();
+    formatPrint(fields, out);
+}
+// Строки выбранных записей для print: список полей разбирается один раз, значения пишутся сразу в UTF-8
+void Database::formatPrint(std::string_view fields, std::string& out) const {
+    TraceSpan span("format");
+    std::pmr::vector<int> columns = printFields(fields);
+    // print ... sort поле: неизвестное поле — по ФИО
+    int sortField = -1;
+    if (size_t sort_pos = fields.find("sort"); sort_pos != std::string_view::npos) {
+        std::string_view rest = fields.substr(sort_pos + 4);
+        sortField = fieldNumber(next_word(rest));
+        if (sortField < 0) sortField = fieldOf<NameField>();
     }
-    // --- Поддержка диапазона вывода: print ... range=начало-конец ---
-    size_t range_start = 0, range_end = output_students.size();
-    size_t range_pos = fields.find(L"range=");
-    if (range_pos != std::wstring::npos) {
-        size_t eq = range_pos + 6;
-        size_t dash = fields.find(L'-', eq);
-        if (dash != std::wstring::npos) {
-            std::wstring start_str = fields.substr(eq, dash - eq);
-            std::wstring end_str = fields.substr(dash + 1, fields.find_first_of(L" ", dash + 1) - (dash + 1));
-            try {
-                range_start = std::stoul(start_str) - 1;
-                range_end = std::stoul(end_str);
-                if (range_start > output_students.size()) range_start = output_students.size();
-                if (range_end > output_students.size()) range_end = output_students.size();
+    size_t range_start, range_end;
+    // --- Выбраны все записи: порядок сортировки уже есть в индексе, берём только нужную страницу ---
+    if (sortField >= 0 && selectedStudents.size() == students.size()) {
+        int kind = fieldOps[sortField].index;
+        if (kind >= 0 && kind != IndexInfo && indexReady[kind]) {
+            parsePrintRange(fields, students.size(), range_start, range_end);
+            out.reserve(out.size() + (range_end - range_start) * 128);
+            for (size_t pos = range_start; pos < range_end; ++pos) {
+                if ((pos - range_start) % 16384 == 0) RequestControl::checkpoint();
+                appendRow(out, students[indexRow(kind, pos)], columns);
             }
-            catch (...) {}
+            return;
         }
     }
+    RowList output_students(selectedStudents.begin(), selectedStudents.end(), RequestArena::current());
+    if (sortField >= 0) {
+        TraceSpan sortSpan("sort");
+        fieldOps[sortField].sort(students, output_students, parallelThreshold);
+    }
+    // --- Поддержка диапазона вывода: print ... range=начало-конец ---
+    parsePrintRange(fields, output_students.size(), range_start, range_end);
+    out.reserve(out.size() + (range_end - range_start) * 128);
     for (size_t idx = range_start; idx < range_end; ++idx) {
-        const Student& student = students[output_students[idx]];
-        std::wistringstream iss(fields);
-        std::wstring field;
-        int fn = 0;
-        while (iss >> field) {
-            if (field == L"id") ++fn, std::wcout << student.id << L"\t";
-            else if (field == L"name") ++fn, std::wcout << student.name << L"\t";
-            else if (field == L"group") ++fn, std::wcout << student.group << L"\t";
-            else if (field == L"rating") ++fn, std::wcout << student.rating << L"\t";
-            else if (field == L"info") ++fn, std::wcout << student.info << L"\t";
-            else break;
-        }
-        if (!fn) std::wcout << student.id << L"\t" << student.name << L"\t" << student.group << L"\t" << student.rating << L"\t" << student.info;
-        std::wcout << L"\n";
-    }
-}
-// Редактирование выбранных записей(всех)
-void Database::update(const std::wstring& command) {
-    auto criteria = parseCriteria(command);
-    for (const auto& crit : criteria) {
-        const std::wstring& field = crit.first;
-        const std::wstring& value = crit.second;
-        for (const size_t& i : selectedStudents) {
-            if (field == L"name") {
-                if (!validate_name(value)) {
-                    std::wcout << L"Ошибка: некорректное ФИО (пример: Иванов Иван Иванович)\n";
-                    break;
-                }
-                wcsncpy(students[i].name, value.c_str(), 63);
-                students[i].name[63] = L'\0';
-            }
-            else if (field == L"group") {
-                int group = 0;
-                try { group = std::stoi(value); }
-                catch (...) { break; }
-                if (!validate_group(group)) {
-                    std::wcout << L"Ошибка: некорректная группа (целое число > 0)\n";
-                    break;
-                }
-                students[i].group = group;
-            }
-            else if (field == L"rating") {
-                double rating = 0;
-                try { rating = std::stod(value); }
-                catch (...) { break; }
-                if (!validate_rating(rating)) {
-                    std::wcout << L"Ошибка: некорректная оценка (от 2 до 5)\n";
-                    break;
-                }
-                students[i].rating = rating;
+        if ((idx - range_start) % 16384 == 0) RequestControl::checkpoint();
+        appendRow(out, students[output_students[idx]], columns);
+    }
+}
+// Подсчёт записей по критериям без изменения выборки
+bool Database::count(std::string_view command) const {
+    Criteria criteria;
+    if (!compileCriteria(command, criteria)) return false;
+    // Одно условие с одним значением, которое целиком покрывается индексом: ответ — длина диапазона позиций, O(log n)
+    size_t indexed = 0, lo = 0, hi = students.size();
+    bool other = criteria.branchCount > 1; // ветки or могут пересекаться — считаем по выборке
+    for (size_t p = 0; p < criteria.predicateCount && !other; ++p) {
+        const Predicate& predicate = criteria.predicates[p];
+        const Criterion& crit = *criteria.begin(predicate);
+        size_t l, h;
+        if (predicate.negate || predicate.count > 1 || crit.prefix)
+            other = true; // у начала слова записи разных слов повторяются — длина диапазона не число записей
+        else if (!indexedCriterion(crit)) {
+            if (!crit.any)
+                other = true; // например, маска с * в середине — проверяется по записям
+        }
+        else if (!indexReady[crit.index])
+            other = true; // индекс ещё строится — считаем сканированием
+        else if (indexRange(crit, l, h))
+            ++indexed, lo = l, hi = h;
+    }
+    size_t total = (indexed <= 1 && !other) ? hi - lo : selectRows(criteria).size();
+    std::wcout << L"Найдено " << total << L" записей\n";
+    return true;
+}
+// Страница записей в порядке индекса без построения выборки
+bool Database::page(std::string_view command) {
+    std::string_view rest = command;
+    int number = fieldNumber(next_word(rest));
+    int kind = number < 0 ? -1 : fieldOps[number].index;
+    if (kind < 0 || kind == IndexInfo) {
+        std::wcout << L"Ошибка: страница строится по полю id, name, group или rating\n";
+        return false;
+    }
+    Criteria criteria;
+    if (!compileCriteria(rest, criteria)) return false;
+    ensureIndex((IndexKind)kind); // странице нужен порядок индекса, сканирование его не даёт
+    // Условие по самому полю (одно значение, без not и or) сужает диапазон позиций, остальные проверяются на проходимых записях
+    size_t lo = 0, hi = students.size();
+    for (size_t p = 0; p < criteria.predicateCount && criteria.branchCount == 1; ++p) {
+        const Predicate& predicate = criteria.predicates[p];
+        if (predicate.field != number || predicate.negate || predicate.count > 1) continue;
+        const Criterion& crit = *criteria.begin(predicate);
+        bool indexed = indexRange(crit, lo, hi);
+        if (indexed || crit.any) criteria.erasePredicate(p);
+        break;
+    }
+    size_t range_start, range_end;
+    std::string out;
+    TraceSpan span("page");
+    parsePrintRange(command, hi - lo, range_start, range_end);
+    if (criteria.empty()) { // Позиционный доступ: O(log n + размер страницы)
+        for (size_t pos = lo + range_start; pos < lo + range_end; ++pos)
+            appendRow(out, students[indexRow(kind, pos)], {});
+    }
+    else {
+        size_t matched = 0;
+        for (size_t pos = lo; pos < hi && matched < range_end; ++pos) {
+            if ((pos - lo) % 16384 == 0) RequestControl::checkpoint();
+            const Student& student = students[indexRow(kind, pos)];
+            if (!matchesCriteria(student, criteria)) continue;
+            if (matched++ >= range_start) appendRow(out, student, {});
+        }
+    }
+    std::wcout << utf8_to_utf16(out);
+    return true;
+}
+// Оценка числа записей, которые пройдёт выборка: ветка стоит ширины самого узкого диапазона индекса
+// (точечный id — одна запись), без такого условия — всех записей; ветки or складываются
+size_t Database::estimateRows(std::string_view command) const {
+    Criteria criteria;
+    if (!compileCriteria(command, criteria, false)) return 0; // ошибка в критериях — команда сразу ответит ошибкой
+    size_t n = students.size();
+    if (criteria.empty() || indexesDirty) return n; // в транзакции индексы могли устареть — диапазоны не считаем
+    size_t total = 0;
+    for (size_t branch = 0; branch < criteria.branchCount; ++branch) {
+        size_t cost = n;
+        for (size_t p = criteria.branchBegin(branch); p < criteria.branchEnd[branch]; ++p) {
+            const Predicate& predicate = criteria.predicates[p];
+            const Criterion* first = criteria.begin(predicate);
+            const Criterion* last = criteria.end(predicate);
+            if (predicate.negate || std::any_of(first, last, [](const Criterion& c) { return c.any; })) continue;
+            if (predicate.count == 1 && first->index == IndexId && !first->range) {
+                cost = 1;
+                break;
             }
-            else if (field == L"info") {
-                students[i].info = value;
+            if (first->index < 0 || !indexReady[first->index] ||
+                !std::all_of(first, last, [](const Criterion& c) { return indexedCriterion(c); }))
+                continue;
+            size_t width = 0;
+            for (const Criterion* value = first; value != last; ++value) {
+                size_t lo = 0, hi = 0;
+                indexRange(*value, lo, hi);
+                width += hi - lo;
             }
+            cost = std::min(cost, width);
         }
+        total += cost;
     }
-    sort();
-    saveToFile(dbFile);
-    studentsBN.clear();
-    studentsBG.clear();
-    studentsBR.clear();
-    selectedStudents.clear();
-    selectedStudents.reserve(students.size());
-    selectedStudents.resize(students.size());
-    for (size_t i = 0; i < students.size(); ++i) {
-        studentsBN.insert(Index{ i });
-        studentsBG.insert(Index{ i });
-        studentsBR.insert(Index{ i });
-        selectedStudents[i] = i;
+    return std::min(total, n);
+}
+// Оценка стоимости команды в записях
+size_t Database::estimateCost(std::string_view full_command) const {
+    std::string_view args = full_command;
+    std::string_view command = next_word(args);
+    size_t n = students.size();
+    size_t change = inTransaction ? 1 : n; // изменение вне транзакции: сортировка, перестроение индексов, снимок файла
+    if (command == "select" || command == "count")
+        return estimateRows(args);
+    if (command == "reselect")
+        return selectedStudents.size();
+    if (command == "print") { // строки диапазона и сортировка выборки (все записи сортировать не нужно — порядок индекса)
+        size_t range_start, range_end;
+        parsePrintRange(args, selectedStudents.size(), range_start, range_end);
+        size_t cost = range_end > range_start ? range_end - range_start : 0;
+        if (args.find("sort") != std::string_view::npos && selectedStudents.size() != n) cost += selectedStudents.size();
+        return cost;
+    }
+    if (command == "page") { // без критериев — только строки страницы
+        std::string_view rest = args;
+        next_word(rest);
+        Criteria criteria;
+        if (!compileCriteria(rest, criteria, false)) return 0;
+        if (!criteria.empty()) return estimateRows(rest);
+        size_t range_start, range_end;
+        parsePrintRange(rest, n, range_start, range_end);
+        return range_end > range_start ? range_end - range_start : 0;
+    }
+    if (command == "update" || command == "remove") { // remove сдвигает все записи и в транзакции
+        CriteriaTokens tokens = lex_criteria(args);
+        size_t rows = tokens.where ? estimateRows(tokens.condition) : selectedStudents.size();
+        return rows + (command == "remove" ? n : change);
     }
-    std::wcout << L"Отредактированы записи\n";
+    if (command == "add")
+        return change;
+    if (command == "begin" || command == "commit" || command == "rollback" || command == "save")
+        return n;
+    return 1;
 }
-// Удаление среди выбранных записей
-void Database::remove() {
-    int count = 0;
-    for (const size_t& i : selectedStudents) {
-        students.erase(students.begin() + i - count);
-        count++;
+// Записи для update/remove ... where
+bool Database::whereRows(std::string_view condition, RowList& rows) {
+    Criteria criteria;
+    if (!compileCriteria(condition, criteria)) return false;
+    if (criteria.empty()) { // пустое where изменило бы все записи — так только явно (where id=*)
+        std::wcout << L"Ошибка: после where ожидались условия\n";
+        return false;
     }
-    saveToFile(dbFile);
-    // Пересоздаем деревья, т.к. все индексы после удаленных записей сдвинулись, а значит данные в деревьях невалидны
-    studentsBN.clear();
-    studentsBG.clear();
-    studentsBR.clear();
-    selectedStudents.clear();
-    selectedStudents.reserve(students.size());
-    selectedStudents.resize(students.size());
+    refreshIndexes(); // в транзакции индексы могли устареть
+    rows = selectRows(criteria);
+    return true;
+}
+// Редактирование выбранных записей (всех) или записей по условиям where
+bool Database::update(std::string_view command) {
+    // Значения разбираются и проверяются один раз до изменения записей (ошибка в любом — записи не меняются),
+    // затем копируются во все выбранные записи
+    CriteriaTokens tokens = lex_criteria(command);
+    if (tokens.error) {
+        commandError(tokens.error, tokens.errorAt);
+        return false;
+    }
+    if (tokens.count == 0) {
+        std::wcout << L"Ошибка: нет значений для изменения (update поле=значение [where условия])\n";
+        return false;
+    }
+    Student parsed{};
+    std::array<bool, FieldCount> assigned{};
+    for (const CriterionToken& token : tokens) {
+        if (token.negate || token.orBefore || token.listItem) {
+            commandError(L"в update только пары поле=значение (без or, not и списков)", token.field);
+            return false;
+        }
+        int field = fieldNumber(token.field);
+        if (field < 0 || !fieldOps[field].editable) {
+            commandError(field < 0 ? L"неизвестное поле" : L"поле не редактируется", token.field);
+            return false;
+        }
+        if (!fieldOps[field].parse(parsed, token.value)) return false;
+        assigned[field] = true;
+    }
+    // update ... where: записи находятся по индексам в той же команде, что и меняются, — между поиском и изменением
+    // сеанс не применяет чужих изменений файла, и выборка сеанса не нужна
+    RowList matched(RequestArena::current());
+    if (tokens.where && !whereRows(tokens.condition, matched)) return false;
+    if (tokens.where && matched.empty()) { // менять нечего: без сортировки, сохранения и оповещения
+        std::wcout << L"Отредактированы записи: 0\n";
+        return true;
+    }
+    waitIndexBuilder(); // записи меняются — фоновое построение индексов должно закончиться
+    auto apply = [&](const auto& rows) {
+        for (int field = 0; field < FieldCount; ++field)
+            if (assigned[field])
+                for (size_t i : rows) fieldOps[field].copy(students[i], parsed);
+        for (size_t i : rows) pendingChanges.updated.push_back(students[i].id);
+        return rows.size();
+    };
+    size_t updated = tokens.where ? apply(matched) : apply(selectedStudents);
+    applyChanges(true);
+    if (tokens.where) std::wcout << L"Отредактированы записи: " << updated << L"\n";
+    else std::wcout << L"Отредактированы записи\n";
+    return true;
+}
+// Удаление выбранных записей или записей по условиям where
+bool Database::remove(std::string_view command) {
+    RowList matched(RequestArena::current());
+    if (!command.empty()) {
+        CriteriaTokens tokens = lex_criteria(command);
+        if (tokens.error) {
+            commandError(tokens.error, tokens.errorAt);
+            return false;
+        }
+        if (!tokens.where || tokens.count) {
+            std::wcout << L"Ошибка: ожидалось remove или remove where условия\n";
+            return false;
+        }
+        if (!whereRows(tokens.condition, matched)) return false;
+        if (matched.empty()) { // удалять нечего: без сохранения и оповещения
+            std::wcout << L"Удалены записи: 0\n";
+            return true;
+        }
+    }
+    waitIndexBuilder();
+    // Один проход: отмеченные записи пропускаются, остальные сдвигаются на место удалённых
+    std::pmr::vector<char> removed(students.size(), 0, RequestArena::current());
+    if (command.empty())
+        for (size_t i : selectedStudents) removed[i] = 1;
+    else
+        for (size_t i : matched) removed[i] = 1;
+    size_t kept = 0;
     for (size_t i = 0; i < students.size(); ++i) {
-        studentsBN.insert(Index{ i });
-        studentsBG.insert(Index{ i });
-        studentsBR.insert(Index{ i });
-        selectedStudents[i] = i;
+        if (removed[i]) {
+            pendingChanges.deleted.push_back(students[i].id);
+            continue;
+        }
+        if (kept != i) students[kept] = std::move(students[i]);
+        ++kept;
     }
+    size_t count = students.size() - kept;
+    students.resize(kept);
+    // Перестраиваем индексы, т.к. номера записей после удаленных сдвинулись, а значит отсортированные массивы невалидны
+    applyChanges(false);
     std::wcout << L"Удалены записи: " << count << L"\n";
+    return true;
 }
 // Добавление записи
-void Database::add(const std::wstring& command) {
+bool Database::add(const std::wstring& command) {
     std::wistringstream iss(command);
-    Student newStudent;
-    iss.getline(newStudent.name, 64, L'\t');
-    iss >> newStudent.group >> newStudent.rating;
+    wchar_t name[64] = {};
+    iss.getline(name, 64, L'\t');
+    int group = 0;
+    double rating = 0;
+    iss >> group >> rating;
     iss.ignore(1);
-    std::getline(iss, newStudent.info);
-    std::wstring name_str(newStudent.name);
-    if (!validate_name(name_str)) {
-        std::wcout << L"Ошибка: некорректное ФИО (пример: Иванов Иван Иванович)\n";
-        return;
+    std::wstring info;
+    std::getline(iss, info);
+    return addStudent(name, group, rating, info);
+}
+// Добавление записи из готовых полей (проверка как у add)
+bool Database::addStudent(const std::wstring& name, int group, double rating, const std::wstring& info) {
+    if (!NameField::valid(name)) {
+        std::wcout << NameField::invalid;
+        return false;
     }
-    if (!validate_group(newStudent.group)) {
-        std::wcout << L"Ошибка: некорректная группа (целое число > 0)\n";
-        return;
+    if (!GroupField::valid(group)) {
+        std::wcout << GroupField::invalid;
+        return false;
     }
-    if (!validate_rating(newStudent.rating)) {
-        std::wcout << L"Ошибка: некорректная оценка (от 2 до 5)\n";
-        return;
+    if (!RatingField::valid(rating)) {
+        std::wcout << RatingField::invalid;
+        return false;
     }
+    Student newStudent;
+    wcsncpy(newStudent.name, name.c_str(), 63);
+    newStudent.name[63] = L'\0';
+    newStudent.group = group;
+    newStudent.rating10 = toRating10(rating);
+    newStudent.info = info;
     newStudent.id = nextId++;
+    waitIndexBuilder();
     students.push_back(newStudent);
-    sort();
-    saveToFile(dbFile);
-    studentsBN.clear();
-    studentsBG.clear();
-    studentsBR.clear();
-    selectedStudents.clear();
-    selectedStudents.reserve(students.size());
-    selectedStudents.resize(students.size());
-    for (size_t i = 0; i < students.size(); ++i) {
-        studentsBN.insert(Index{ i });
-        studentsBG.insert(Index{ i });
-        studentsBR.insert(Index{ i });
-        selectedStudents[i] = i;
-    }
+    pendingChanges.inserted.push_back(newStudent.id);
+    applyChanges(true);
     std::wcout << L"Добавлен студент: " << newStudent.name << L"\n";
+    return true;
+}
+
+// -------------------------------------------------- Транзакции --------------------------------------------------
+// Начало транзакции: запоминаем записи, чтобы rollback мог вернуть их без чтения файла
+bool Database::begin() {
+    if (inTransaction) {
+        std::wcout << L"Ошибка: транзакция уже начата\n";
+        return false;
+    }
+    if (dbFile.empty()) {
+        std::wcout << L"Ошибка: сначала откройте базу данных\n";
+        return false;
+    }
+    txnSnapshot = students;
+    txnNextId = nextId;
+    inTransaction = true;
+    std::wcout << L"Транзакция начата\n";
+    return true;
+}
+// Применение транзакции: одна сортировка, одно перестроение индексов, одна запись файла и одно оповещение
+bool Database::commit() {
+    if (!inTransaction) {
+        std::wcout << L"Ошибка: транзакция не начата\n";
+        return false;
+    }
+    inTransaction = false;
+    txnSnapshot.clear();
+    txnSnapshot.shrink_to_fit();
+    // Одна запись могла меняться несколько раз: подписчикам уходит итоговое состояние каждого id
+    std::map<int, char> state;
+    for (int id : pendingChanges.inserted) state[id] = 'i';
+    for (int id : pendingChanges.updated) state.emplace(id, 'u');
+    for (int id : pendingChanges.deleted) {
+        auto [it, added] = state.emplace(id, 'd');
+        if (!added && it->second == 'i') state.erase(it); // добавлена и удалена внутри транзакции
+        else it->second = 'd';
+    }
+    pendingChanges = ChangeSet{};
+    for (const auto& [id, st] : state)
+        (st == 'i' ? pendingChanges.inserted : st == 'u' ? pendingChanges.updated : pendingChanges.deleted).push_back(id);
+    size_t changed = state.size();
+    if (indexesDirty || changed) {
+        indexesDirty = false;
+        sort();
+        rebuildIndexes();
+        saveToFile(dbFile);
+    }
+    std::wcout << L"Транзакция применена (изменений: " << changed << L")\n";
+    return true;
+}
+// Отмена транзакции: возвращаем записи из снимка, файл не трогаем
+bool Database::rollback() {
+    if (!inTransaction) {
+        std::wcout << L"Ошибка: транзакция не начата\n";
+        return false;
+    }
+    waitIndexBuilder();
+    inTransaction = indexesDirty = false;
+    students = std::move(txnSnapshot);
+    txnSnapshot.clear();
+    nextId = txnNextId;
+    pendingChanges = ChangeSet{};
+    rebuildIndexes();
+    std::wcout << L"Транзакция отменена\n";
+    return true;
 }
 
 void Database::sort() {
-    std::sort(students.begin(), students.end(), [&](const Student& a, const Student& b) {
-        if (a.group != b.group)
-            return a.group < b.group;
-        if (wcscmp(a.name, b.name))
-            return wcscmp(a.name, b.name) < 0;
-        if (a.rating != b.rating)
-            return a.rating < b.rating;
-        return a.info < b.info;
+    waitIndexBuilder();
+    // Сортируем перестановку по ключу (группа + первые два символа ФИО), а не сами записи:
+    // Student тяжёлый (массив ФИО + wstring), двигать его при каждом сравнении дорого.
+    // Перестановка и буферы сортировки размером с таблицу — из кучи, а не из арены запроса
+    RowList order(students.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    sortRowsByKey(order, parallelThreshold,
+        [&](size_t i) { return groupKey(students[i].group) << 32 | namePrefixKey(students[i].name) >> 32; },
+        [&](size_t a, size_t b) {
+            const Student& x = students[a];
+            const Student& y = students[b];
+            if (int res = wcscmp(x.name, y.name))
+                return res < 0;
+            if (x.rating10 != y.rating10)
+                return x.rating10 < y.rating10;
+            return x.info < y.info;
         });
+    // Переставляем записи один раз и только если порядок изменился
+    size_t first = 0;
+    while (first < order.size() && order[first] == first) ++first;
+    if (first == order.size()) return;
+    std::vector<Student> sorted;
+    sorted.reserve(students.size());
+    for (size_t i : order) sorted.push_back(std::move(students[i]));
+    students.swap(sorted);
 }
 // ------------------- Реализация поддержки оповещений -------------------
 size_t Database::getVersion() const { return version; }
 void Database::clearCallbacks() { changeCallbacks.clear(); }
-void Database::notifyOnChange(std::function<void()> callback) { changeCallbacks.push_back(callback); }
+void Database::notifyOnChange(ChangeCallback callback) { changeCallbacks.push_back(callback); }
 void Database::notifyChanged() {
+    ChangeSet changes = takeChanges();
+    for (auto& cb : changeCallbacks) cb(version, changes);
+}
+Database::ChangeSet Database::takeChanges() {
     ++version;
-    for (auto& cb : changeCallbacks) cb();
+    // Подписчикам вместе с id отдаём новые строки, чтобы они могли обновить у себя только эти записи
+    ChangeSet changes = std::move(pendingChanges);
+    pendingChanges = ChangeSet{};
+    if (!indexReady[IndexId] && changes.inserted.size() + changes.updated.size() > 1) {
+        // Индекс id ещё строится: находим все изменённые записи за один проход вместо поиска каждой
+        std::map<int, size_t> rowById;
+        for (const auto* ids : { &changes.inserted, &changes.updated })
+            for (int id : *ids) rowById[id] = students.size();
+        for (size_t i = 0; i < students.size(); ++i)
+            if (auto it = rowById.find(students[i].id); it != rowById.end()) it->second = i;
+        for (const auto* ids : { &changes.inserted, &changes.updated })
+            for (int id : *ids)
+                if (size_t row = rowById[id]; row < students.size())
+                    changes.rows.push_back(formatLine(students[row]));
+        return changes;
+    }
+    for (const auto* ids : { &changes.inserted, &changes.updated })
+        for (int id : *ids)
+            if (size_t row = findById(id); row < students.size())
+                changes.rows.push_back(formatLine(students[row]));
+    return changes;
+}
+
+// -------------------------------------------------- Доступ из программ (libsubd) --------------------------------------------------
+// Номера записей по критериям без вывода и без изменения выборки
+bool Database::query(std::string_view criteria, std::vector<size_t>& rows) {
+    syncWithFile();
+    refreshIndexes();
+    Criteria compiled;
+    if (!compileCriteria(criteria, compiled)) return false;
+    RowList found = selectRows(compiled);
+    rows.assign(found.begin(), found.end());
+    return true;
+}
+// Запись по номеру: строки не копируются
+Database::RowView Database::row(size_t index) const {
+    const Student& student = students[index];
+    return RowView{ student.id, student.name, student.group, student.rating10 / 10.0, student.info.c_str() };
 }
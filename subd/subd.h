@@ -4,7 +4,10 @@
 #include <iostream>
 #include <sstream>
 #include <vector>
+#include <array>
 #include <string>
+#include <string_view>
+#include <memory_resource>
 #include <fstream>
 #include <algorithm>
 #include <map>
@@ -15,10 +18,23 @@
 #include <cstring>
 #include <codecvt>
 #include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <exception>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <chrono>
+#include <stdexcept>
+#include <sys/types.h>
 
 // -------------------------------------------------- Функции перевода строк из разных кодировок --------------------------------------------------
 // Конвертация UTF-8 (файл) → UTF-16 (в памяти)
-std::wstring utf8_to_utf16(const std::string& utf8);
+std::wstring utf8_to_utf16(std::string_view utf8);
 // Конвертация UTF-16 → UTF-8 (для имени файла)
 std::string utf16_to_utf8(const std::wstring& utf16);
 
@@ -35,13 +51,261 @@ protected:
     std::string do_grouping() const override { return ""; }
 };
 
+// Класс для временного перенаправления потока
+class WcoutRedirect {
+    std::wstreambuf* old_buf;
+    std::wstringstream buffer;
+    
+public:
+    WcoutRedirect() : old_buf(std::wcout.rdbuf()) {
+        std::wcout.rdbuf(buffer.rdbuf());
+    }
+    
+    ~WcoutRedirect() {
+        std::wcout.rdbuf(old_buf);
+    }
+    
+    std::wstring getOutput() const {
+        return buffer.str();
+    }
+};
+
+// Парсинг конфига (строки "ключ = значение")
+std::map<std::string, std::string> read_config(const std::string& filename);
+
+// -------------------------------------------------- Разбор команд --------------------------------------------------
+// Команда разбирается прямо в байтах UTF-8, как она пришла от клиента: слова и значения — ссылки на исходную строку
+// Пара поле=значение (кавычки вокруг значения уже сняты); список поле=a,b,c даёт по паре на значение
+struct CriterionToken {
+    std::string_view field;
+    std::string_view value;
+    bool negate = false;    // перед условием стоит not
+    bool orBefore = false;  // перед условием стоит or: с него начинается новая ветка
+    bool listItem = false;  // очередное значение списка предыдущего условия (поле=a,b)
+};
+// Пары поле=значение команды за один проход, без выделения памяти
+struct CriteriaTokens {
+    static constexpr size_t capacity = 64;
+    std::array<CriterionToken, capacity> items;
+    size_t count = 0;
+    const wchar_t* error = nullptr;     // nullptr — разбор успешен, иначе описание ошибки
+    bool where = false;                 // встретилось слово where: пары до него — значения update, после — условия
+    std::string_view condition;         // команда после where
+    std::string_view errorAt;           // фрагмент команды, на котором остановился разбор
+    const CriterionToken* begin() const { return items.data(); }
+    const CriterionToken* end() const { return items.data() + count; }
+};
+// Разбор строки вида name=Кузьмин* group=101,105 or not info="a, b": пары через пробелы, значение в кавычках может
+// содержать пробелы и запятые; слова or и not (в любом регистре) — связки между условиями, на where разбор останавливается
+CriteriaTokens lex_criteria(std::string_view command);
+// Следующее слово до пробела; rest сдвигается за него (пустое — слова кончились)
+std::string_view next_word(std::string_view& rest);
+
+// -------------------------------------------------- Общая память для локальных клиентов --------------------------------------------------
+// Кольцевой буфер для больших ответов: клиент на Unix-сокете просит его командой "shm <размер>", сервер создаёт memfd
+// и передаёт дескриптор через SCM_RIGHTS. Ответ тогда идёт кадром -3 с общей длиной, а байты — через буфер:
+// сервер пишет кусок, сдвигает head и шлёт в сокет длину куска; клиент копирует кусок и сдвигает tail
+struct ShmRing {
+    std::atomic<uint64_t> head;     // сколько байт всего записал сервер
+    std::atomic<uint64_t> tail;     // сколько байт всего прочитал клиент
+    uint64_t capacity;              // размер области данных сразу за заголовком
+    char* data() { return reinterpret_cast<char*>(this + 1); }
+};
+
 // Валидация ФИО (три слова, кириллица, с заглавной буквы)
 bool validate_name(const std::wstring& name);
 // Валидация группы (целое число > 0)
 bool validate_group(int group);
-// Валидация оценки (2.0 <= x <= 5.0)
+// Валидация оценки (2.0 <= x <= 5.0, одна цифра после запятой)
 bool validate_rating(double rating);
 
+// Общий пул потоков для параллельного выполнения запросов (фильтрация, сортировка)
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+    // Выполнить fn(0..count-1): задачи разбирают рабочие потоки и вызывающий поток, возврат после завершения всех.
+    // Исключение из любой задачи пробрасывается в вызывающий поток
+    void parallelFor(size_t count, const std::function<void(size_t)>& fn);
+    size_t size() const { return workers.size() + 1; }
+    // Пул процесса (создаётся при первом обращении, размер задаётся configure до него; 0 - по числу ядер)
+    static ThreadPool& instance();
+    static void configure(size_t threads);
+private:
+    static size_t configuredThreads;
+    struct Job;
+    void workerLoop();
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Job>> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+// Монотонная арена одного запроса: временные массивы разбора, плана, пересечения и вывода берутся из неё подряд,
+// без malloc и без общей для потоков кучи, и освобождаются разом после отправки ответа (reset за O(1): начальный
+// блок остаётся, блоки сверх него возвращаются в кучу). У каждого сеанса своя арена; пока действует Scope,
+// она текущая для потока, и ядро берёт память временных массивов через RequestArena::current()
+class RequestArena : public std::pmr::memory_resource {
+public:
+    explicit RequestArena(size_t initialBytes = 256 * 1024);
+    // Освободить всё выделенное за запрос
+    void reset();
+    // Память временных массивов текущего запроса потока (без арены — обычная куча)
+    static std::pmr::memory_resource* current();
+    // Арена текущая для потока до конца области видимости, на выходе сбрасывается
+    class Scope {
+    public:
+        explicit Scope(RequestArena& arena);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        RequestArena& arena;
+        std::pmr::memory_resource* previous;
+    };
+    // Статистика всех арен процесса (команда memory)
+    struct Stats {
+        size_t requests;    // запросов (сбросов арен)
+        size_t bytes;       // выделено байт за все запросы
+        size_t peakBytes;   // больше всего байт за один запрос
+        size_t heapBlocks;  // блоков, взятых из кучи сверх начального
+        size_t heapBytes;
+    };
+    static Stats stats();
+private:
+    // Блоки сверх начального: берутся из обычной кучи и учитываются в статистике
+    struct Upstream : std::pmr::memory_resource {
+        void* do_allocate(size_t bytes, size_t alignment) override;
+        void do_deallocate(void* p, size_t bytes, size_t alignment) override;
+        bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+    };
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void*, size_t, size_t) override {} // память возвращается только вся сразу (reset)
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    std::unique_ptr<std::byte[]> initial;
+    Upstream upstream;
+    std::pmr::monotonic_buffer_resource buffer;
+    size_t used = 0; // байт за текущий запрос
+};
+
+// Запрос прерван в точке проверки: отменён командой cancel или вышел его срок
+class RequestInterrupted : public std::runtime_error {
+public:
+    explicit RequestInterrupted(bool expired)
+        : std::runtime_error(expired ? "request deadline exceeded" : "request cancelled"), expired(expired) {}
+    bool expired; // false — отменён
+};
+
+// Отмена и срок выполнения запроса. У каждого сеанса сервера свой объект; пока действует Scope, он текущий для потока.
+// Длинные проходы ядра (фильтрация, print, page, пересечение диапазонов) между кусками в тысячи записей вызывают
+// checkpoint(), и отменённый или просроченный запрос завершается исключением RequestInterrupted до изменения записей
+class RequestControl {
+public:
+    using Clock = std::chrono::steady_clock;
+    // Новый запрос: сброс отмены и срок (Clock::time_point::max() — без срока)
+    void start(Clock::time_point deadline);
+    // Отменить текущий запрос (из любого потока)
+    void cancel() { cancelled.store(true, std::memory_order_relaxed); }
+    bool isCancelled() const { return cancelled.load(std::memory_order_relaxed); }
+    bool isExpired() const { return Clock::now() >= deadline; }
+    Clock::time_point getDeadline() const { return deadline; }
+    // Бросить RequestInterrupted, если запрос отменён или просрочен
+    void check() const;
+    // Объект текущего запроса потока (nullptr — запрос не прерывается, например в libsubd или в рабочих потоках пула)
+    static RequestControl* current();
+    // check() текущего запроса потока, если он есть
+    static void checkpoint();
+    class Scope {
+    public:
+        explicit Scope(RequestControl& control);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        RequestControl* previous;
+    };
+private:
+    std::atomic<bool> cancelled{ false };
+    Clock::time_point deadline = Clock::time_point::max();
+};
+
+// Трассировка запроса: интервалы его этапов (приём, разбор критериев, проход по диапазонам индексов, пересечение,
+// фильтрация, форматирование print, отправка). Сервер включает её для выбранных запросов; пока действует Scope,
+// ядро отмечает этапы через TraceSpan. Без трассировки этап стоит одной проверки указателя
+class RequestTrace {
+public:
+    using Clock = std::chrono::steady_clock;
+    struct Span {
+        const char* name;       // имя этапа (строковый литерал)
+        Clock::time_point start, end;
+    };
+    static constexpr size_t maxSpans = 1024; // этапы сверх этого числа не записываются (счётчик dropped)
+    // Новый запрос: этапы прошлого очищаются, память под них остаётся
+    void start(Clock::time_point begin);
+    void add(const char* name, Clock::time_point start, Clock::time_point end);
+    Clock::time_point begin() const { return beginTime; }
+    const std::vector<Span>& spans() const { return list; }
+    size_t dropped() const { return droppedSpans; }
+    // Трассировка текущего запроса потока (nullptr — запрос не трассируется)
+    static RequestTrace* current();
+    // Трассировка (или nullptr) текущая для потока до конца области видимости
+    class Scope {
+    public:
+        explicit Scope(RequestTrace* trace);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    private:
+        RequestTrace* previous;
+    };
+private:
+    std::vector<Span> list;
+    Clock::time_point beginTime;
+    size_t droppedSpans = 0;
+};
+
+// Этап запроса от создания до конца области видимости (записывается, если у потока есть трассировка)
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name)
+        : trace(RequestTrace::current()), name(name), start(trace ? RequestTrace::Clock::now() : RequestTrace::Clock::time_point()) {}
+    ~TraceSpan() {
+        if (trace) trace->add(name, start, RequestTrace::Clock::now());
+    }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+    RequestTrace* trace;
+    const char* name;
+    RequestTrace::Clock::time_point start;
+};
+
+// Фоновая запись снимков БД на диск: один поток по очереди пишет временный файл, делает fsync и подменяет им основной
+class SnapshotWriter {
+public:
+    struct Job {
+        std::string path;                       // файл БД (UTF-8)
+        std::string data;                       // снимок: строки всех записей в формате файла
+        std::function<void(bool ok)> done;      // вызывается в потоке записи после rename (или ошибки)
+        std::function<void(int fd)> written;    // вызывается после fsync временного файла, до rename
+    };
+    void enqueue(Job job);
+    // Писатель процесса (при завершении программы дописывает очередь)
+    static SnapshotWriter& instance();
+    ~SnapshotWriter();
+private:
+    SnapshotWriter();
+    void writerLoop();
+    static bool writeFile(const Job& job);
+    std::thread worker;
+    std::deque<Job> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
 // Ядро БД
 class Database {
 private:
@@ -50,97 +314,498 @@ private:
         int id; // уникальный идентификатор
         wchar_t name[64];
         int group;
-        double rating;
+        unsigned char rating10; // оценка в десятых долях (20..50 для 2.0..5.0)
         std::wstring info;
     };
 private:
     std::vector<Student> students;                   // Все записи
     enum class Index : size_t {};
-    struct CompareByName {                                                       // Компаратор для дерева ФИО
+    struct CompareByName {                                                       // Порядок массива ФИО (и поиск в нём)
         using is_transparent = void;                                             //
         const std::vector<Student>* students_ptr;                                //
         bool operator()(Index a, const wchar_t* b) const;                        //
         bool operator()(const wchar_t* a, Index b) const;                        //
         bool operator()(Index a, Index b) const;                                 //
     };                                                                           //
-    std::set<Index, CompareByName> studentsBN{ CompareByName{&students} };       // Записи в дереве по ФИО
+    // Индексы перестраиваются целиком после каждого изменения, поэтому вместо деревьев — отсортированные массивы:
+    // позиция в массиве и есть порядковый номер (подсчёт диапазона — разность позиций, страница — срез)
+    std::vector<Index> studentsBN;                                               // Записи по ФИО
 
-    struct CompareByGroup {                                                      // Компаратор для дерева Группы
+    struct CompareByGroup {                                                      // Порядок массива Группы (и поиск в нём)
         using is_transparent = void;                                             //
         const std::vector<Student>* students_ptr;                                //
         bool operator()(Index a, int group) const;                               //
         bool operator()(int group, Index b) const;                               //
         bool operator()(Index a, Index b) const;                                 //
     };                                                                           //
-    std::set<Index, CompareByGroup> studentsBG{ CompareByGroup{&students} };     // Записи в дереве по Группе
+    std::vector<Index> studentsBG;                                               // Записи по Группе
 
-    struct CompareByRating {                                                     // Компаратор для дерева Оценки
+    // Оценка принимает всего 31 значение (2.0, 2.1, ..., 5.0), поэтому вместо дерева — корзина на каждое значение
+    static constexpr int ratingMin = 20;                                         // 2.0 в десятых
+    static constexpr int ratingMax = 50;                                         // 5.0 в десятых
+    std::array<std::vector<size_t>, ratingMax - ratingMin + 1> studentsBR;       // Записи по Оценке: номера записей по возрастанию в каждой корзине
+    std::array<size_t, ratingMax - ratingMin + 2> ratingStart{};                 // Позиция начала каждой корзины в порядке оценки
+
+    struct CompareById {                                                         // Порядок массива id (и поиск в нём)
         using is_transparent = void;                                             //
         const std::vector<Student>* students_ptr;                                //
-        bool operator()(Index a, double rating) const;                           //
-        bool operator()(double rating, Index b) const;                           //
+        bool operator()(Index a, int id) const;                                  //
+        bool operator()(int id, Index b) const;                                  //
         bool operator()(Index a, Index b) const;                                 //
     };                                                                           //
-    std::set<Index, CompareByRating> studentsBR{ CompareByRating{&students} };   // Записи в дереве по Оценке
+    std::vector<Index> studentsBI;                                               // Записи по id (для диапазонов id=a-b)
+    std::vector<size_t> studentsById;                                            // Прямой массив id → номер записи (для точечного id=N)
+
+    // Слова поля info для поиска info=~слово: словарь слов в нижнем регистре по возрастанию и список записей
+    // каждого слова. Списки идут подряд в порядке словаря (позиция — как в корзинах оценки); номера записей в списке
+    // возрастают и хранятся разностями соседних в varint — обычно 1–2 байта на запись вместо 8
+    std::vector<std::wstring> infoWords;                                         // Словарь
+    std::vector<size_t> infoWordStart;                                           // Позиция начала списка каждого слова (последняя — всего)
+    std::vector<size_t> infoWordBytes;                                           // Смещение списка каждого слова в infoPostings
+    std::vector<uint8_t> infoPostings;                                           // Списки всех слов подряд
+
+    // Индексы, которые не указаны в eager_indexes, строятся в фоне после open/изменения (или при первом обращении),
+    // а запросы до их готовности выполняются сканированием записей
+    enum IndexKind { IndexId, IndexName, IndexGroup, IndexRating, IndexInfo, IndexCount };
+    static std::array<bool, IndexCount> eagerIndexes;                            // Строятся сразу (синхронно)
+    static bool backgroundIndexes;                                               // Остальные строятся в фоне, иначе — при первом обращении
+    std::array<std::atomic<bool>, IndexCount> indexReady{};                      // Индекс построен и им можно пользоваться
+    std::thread indexBuilder;                                                    // Фоновое построение индексов (записи не меняются, пока он идёт)
+
+    // -------------------------------------------------- Схема записи --------------------------------------------------
+    // Поля Student описаны типами: имя в командах, член структуры, вид значения и индекс. По виду значения
+    // генерируются разбор критерия, проверка записи, вывод, строка файла, сравнение и update (таблица fieldOps).
+    // Имя поля сравнивается со строкой один раз при разборе команды, дальше везде номер поля в Schema.
+    // Новый столбец — член Student и его описание в Schema
+    enum class FieldKind { Int, Name, Rating, Text };
+    template <auto Member, FieldKind Kind, int IndexOf, bool Editable>
+    struct FieldDef {
+        static constexpr auto member = Member;
+        static constexpr FieldKind kind = Kind;
+        static constexpr int index = IndexOf;       // IndexKind или -1 (поле без индекса)
+        static constexpr bool editable = Editable;  // меняется командой update
+    };
+    struct IdField : FieldDef<&Student::id, FieldKind::Int, IndexId, false> {
+        static constexpr const char* name = "id";
+        static bool valid(int) { return true; }
+        static constexpr const wchar_t* invalid = L"";
+    };
+    struct NameField : FieldDef<&Student::name, FieldKind::Name, IndexName, true> {
+        static constexpr const char* name = "name";
+        static bool valid(const std::wstring& value) { return validate_name(value); }
+        static constexpr const wchar_t* invalid = L"Ошибка: некорректное ФИО (пример: Иванов Иван Иванович)\n";
+    };
+    struct GroupField : FieldDef<&Student::group, FieldKind::Int, IndexGroup, true> {
+        static constexpr const char* name = "group";
+        static bool valid(int value) { return validate_group(value); }
+        static constexpr const wchar_t* invalid = L"Ошибка: некорректная группа (целое число > 0)\n";
+    };
+    struct RatingField : FieldDef<&Student::rating10, FieldKind::Rating, IndexRating, true> {
+        static constexpr const char* name = "rating";
+        static bool valid(double value) { return validate_rating(value); }
+        static constexpr const wchar_t* invalid = L"Ошибка: некорректная оценка (от 2 до 5, одна цифра после запятой)\n";
+    };
+    struct InfoField : FieldDef<&Student::info, FieldKind::Text, IndexInfo, true> { // индекс — по словам, порядка записей не даёт
+        static constexpr const char* name = "info";
+        static bool valid(const std::wstring& value) { return value.find(L'\n') == std::wstring::npos; }
+        static constexpr const wchar_t* invalid = L"Ошибка: перевод строки в информации\n";
+    };
+    using Schema = std::tuple<IdField, NameField, GroupField, RatingField, InfoField>; // порядок столбцов файла и print
+    static constexpr int FieldCount = (int)std::tuple_size_v<Schema>;
+    // Номер поля в Schema
+    template <typename F, int I = 0>
+    static constexpr int fieldOf() {
+        if constexpr (std::is_same_v<F, std::tuple_element_t<I, Schema>>) return I;
+        else return fieldOf<F, I + 1>();
+    }
+
+    // Критерий запроса, разобранный один раз: поле, границы значения и проверка записи для этого поля
+    struct Criterion {
+        int field = -1;                         // номер поля в Schema
+        int index = -1;                         // IndexKind поля (-1 — без индекса)
+        bool any = false;                       // "*" или "*-*": поле не ограничено
+        bool range = false;                     // значение "от-до"
+        bool fromAny = false, toAny = false;    // открытая граница диапазона ("*")
+        long long lo = 0, hi = 0;               // Int — границы, Rating — границы в десятых (lo > hi — ничего)
+        std::wstring from, to;                  // Name, Text — маска (без диапазона from == to) или границы
+        bool word = false, prefix = false;      // Text: info=~слово (from — слово в нижнем регистре), info=~нача* — начало слова
+        bool (*test)(const Criterion&, const Student&) = nullptr;
+    };
+    // Номера записей во временных массивах запроса (память из RequestArena::current())
+    using RowList = std::pmr::vector<size_t>;
+    // Условие на поле: запись подходит, если поле совпадает с любым из значений списка (group=101,105 — IN),
+    // а с not — если ни с одним
+    struct Predicate {
+        int field = -1;
+        bool negate = false;
+        size_t first = 0, count = 0;            // значения в Criteria::values
+    };
+    // Критерии команды: ветки через or, в ветке — условия через пробел (должны выполняться все), без выделения памяти.
+    // Повтор поля в ветке — ещё одно условие, а не замена прежнего
+    struct Criteria {
+        static constexpr size_t capacity = CriteriaTokens::capacity;
+        std::array<Criterion, capacity> values;
+        std::array<Predicate, capacity> predicates;
+        std::array<size_t, capacity> branchEnd{}; // условия ветки b — [branchBegin(b), branchEnd[b])
+        size_t valueCount = 0, predicateCount = 0, branchCount = 0;
+        bool empty() const { return predicateCount == 0; }
+        size_t branchBegin(size_t branch) const { return branch ? branchEnd[branch - 1] : 0; }
+        const Criterion* begin(const Predicate& predicate) const { return values.data() + predicate.first; }
+        const Criterion* end(const Predicate& predicate) const { return values.data() + predicate.first + predicate.count; }
+        void erasePredicate(size_t p) {
+            std::move(predicates.begin() + p + 1, predicates.begin() + predicateCount, predicates.begin() + p);
+            --predicateCount;
+            for (size_t b = 0; b < branchCount; ++b)
+                if (branchEnd[b] > p) --branchEnd[b];
+        }
+    };
+
+    // Операции над полем, сгенерированные по его описанию
+    struct FieldOps {
+        const char* name;
+        int index;
+        bool editable;
+        const wchar_t* (*compile)(Criterion& criterion, std::string_view value); // разбор значения критерия (ошибка или nullptr)
+        bool (*test)(const Criterion& criterion, const Student& student);  // запись подходит под критерий
+        void (*format)(std::string& line, const Student& student);         // значение в строке файла и print (UTF-8)
+        bool (*equal)(const Student& a, const Student& b);
+        bool (*parse)(Student& to, std::string_view value);                // значение для update (false — не прошло проверку)
+        void (*copy)(Student& to, const Student& from);
+        void (*sort)(const std::vector<Student>& students, RowList& rows, size_t parallelThreshold); // стабильно
+    };
+    static const std::array<FieldOps, FieldCount> fieldOps;
+    template <typename... F> static std::array<FieldOps, sizeof...(F)> makeFieldOps(const std::tuple<F...>*);
+    template <typename F> static const wchar_t* compileField(Criterion& criterion, std::string_view value);
+    template <typename F> static bool testField(const Criterion& criterion, const Student& student);
+    template <typename F> static void formatField(std::string& line, const Student& student);
+    template <typename F> static bool equalField(const Student& a, const Student& b);
+    template <typename F> static bool parseField(Student& to, std::string_view value);
+    template <typename F> static void copyField(Student& to, const Student& from);
+    template <typename F> static void sortField(const std::vector<Student>& students, RowList& rows, size_t parallelThreshold);
+    // Номер поля по имени (-1 — нет такого поля)
+    static int fieldNumber(std::string_view name);
 
     std::vector<size_t> selectedStudents;            // Выбранные записи 
     std::wstring dbFile;  // Имя файла базы данных
+
+    // Состояние файла на диске для отдачи print без форматирования (sendfile)
+    bool fileCanonical = false;       // файл побайтно совпадает с тем, что напечатает print для всех записей
+    std::vector<off_t> lineOffsets;   // смещение начала каждой строки в файле (+ конец файла)
+    struct FileStamp {                // по чему узнаём, что файл не подменили после загрузки/сохранения
+        dev_t dev = 0;
+        ino_t ino = 0;
+        off_t size = 0;
+        long mtime_sec = 0;
+        long mtime_nsec = 0;
+        bool operator==(const FileStamp& other) const;
+    };
+    // Сохранения идут в фоне, поэтому отпечаток файла и счётчики записей общие с потоком записи
+    // (под мьютексом; живут, пока не допишется последнее сохранение, даже если сеанс уже закрыт)
+    struct SaveState {
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t pending = 0;           // сохранений в очереди на запись
+        size_t failed = 0;            // неудачных записей с прошлой проверки
+        bool stampValid = false;      // stamp соответствует файлу, который совпадает с памятью
+        FileStamp stamp;              // по чему узнаём, что файл не подменили после загрузки/сохранения
+        // id изменений из неудачных записей: подписчики их не получили, уйдут со следующим сохранением
+        std::vector<int> unsentInserted, unsentUpdated, unsentDeleted;
+        bool unsentReload = false;
+    };
+    std::shared_ptr<SaveState> saveState = std::make_shared<SaveState>();
+    // Дождаться записи на диск всех сохранений сеанса (false — какое-то не удалось)
+    bool waitSaved();
+    // Строка записи в формате файла и print (UTF-8, с \n)
+    static std::string formatLine(const Student& student);
+    // Снять отпечаток файла по пути (или по открытому дескриптору, если fd >= 0)
+    static bool statFile(const std::string& path, FileStamp& stamp, int fd = -1);
     int nextId = 1; // для генерации новых id
+
+    // Реестр открытых файлов процесса с кэшем загруженных записей: повторный open неизменённого файла
+    // (тот же отпечаток) копирует записи из памяти вместо разбора. Записи файлов, которые не открыты
+    // ни одним экземпляром, вытесняются по давности использования, пока кэш больше бюджета
+    struct CachedTable {
+        FileStamp stamp;                  // отпечаток файла, из которого загружены записи
+        std::vector<Student> students;
+        std::vector<off_t> lineOffsets;
+        bool canonical = false;
+        int nextId = 1;
+        size_t fixedRatings = 0;          // предупреждение при загрузке повторяется и из кэша
+        size_t bytes = 0;                 // память записи кэша
+        bool peerSave = false;            // записи сохранения экземпляра процесса (о нём клиентов оповещает записавший)
+    };
+    struct OpenFile {
+        size_t sessions = 0;              // сколько экземпляров Database держат файл открытым
+        size_t records = 0;               // записей при последней загрузке
+        size_t tableBytes = 0;            // память одного экземпляра: записи, смещения строк и индексы (оценка)
+        uint64_t lastUse = 0;             // когда файл последний раз открывали или закрывали
+        std::shared_ptr<const CachedTable> cached;
+        // Слежение за изменениями файла извне
+        uint64_t generation = 0;          // сколько раз файл перечитан после записи другим процессом
+        std::shared_ptr<const CachedTable> latest; // последнее перечитанное или сохранённое другим экземпляром содержимое
+                                                   // (пока его не применили все экземпляры)
+        size_t unsynced = 0;              // экземпляров, которые ещё не применили latest
+        uint64_t latestWriter = 0;        // экземпляр, чьё сохранение перечитано в latest (ему применять нечего; 0 — запись извне)
+        struct OwnWrite {
+            FileStamp stamp;
+            uint64_t writer;              // instanceId сохранившего экземпляра
+        };
+        std::vector<OwnWrite> ownWrites;  // сохранения экземпляров процесса, о которых ещё не пришло событие
+    };
+    struct FileRegistry {
+        std::mutex mutex;
+        std::map<std::string, OpenFile> files;  // по полному пути
+        size_t budget = 0;                // байт на кэш (0 — кэш выключен)
+        size_t cachedBytes = 0;
+        uint64_t clock = 0;
+        size_t hits = 0, misses = 0, evictions = 0;
+        bool watching = false;            // следить за открытыми файлами (inotify)
+        int inotifyFd = -1;
+        std::map<int, std::string> watchedDirs; // дескриптор слежения → каталог
+    };
+    static FileRegistry& registry();
+    std::string registeredPath;           // файл, который этот экземпляр держит открытым в реестре
+    uint64_t syncedGeneration = 0;        // до какой перечитки файла записи этого экземпляра обновлены
+    uint64_t instanceId = ++instanceCount; // номер экземпляра (по нему узнаются его сохранения)
+    static std::atomic<uint64_t> instanceCount;
+    // Перейти в реестре на другой файл (пустой путь — закрыть), records/bytes — загруженные данные
+    void registerFile(const std::string& path, size_t records, size_t bytes);
+    // Вытеснить записи кэша незанятых файлов, пока кэш (с новой записью incoming байт) больше бюджета (под registry().mutex)
+    static void trimCache(FileRegistry& reg, size_t incoming = 0);
+    // Память записей и смещений строк
+    static size_t tableBytes(const std::vector<Student>& students, const std::vector<off_t>& lineOffsets);
+    // Разбор файла БД в таблицу
+    static void readTable(std::istream& file, CachedTable& table);
+    // Поток слежения: события inotify по каталогам открытых файлов
+    static void watchLoop();
+    // Файл записал другой процесс: перечитать один раз и оповестить (вызывается потоком слежения)
+    static void reloadChanged(const std::string& path);
+public:
+    // Изменения с прошлого оповещения (передаются подписчикам вместе с версией)
+    struct ChangeSet {
+        std::vector<int> inserted;          // id добавленных записей
+        std::vector<int> updated;           // id изменённых записей
+        std::vector<int> deleted;           // id удалённых записей
+        std::vector<std::string> rows;      // новые строки добавленных и изменённых записей (UTF-8, как в файле, с \n)
+        bool reload = false;                // изменения неизвестны (файл перезаписан извне, прежнего содержимого нет) — перечитать всё
+    };
+    using ChangeCallback = std::function<void(size_t version, const ChangeSet& changes)>;
+    // Оповещение об изменении открытого файла другим процессом (path — полный путь)
+    using ExternalChangeCallback = std::function<void(const std::string& path, const ChangeSet& changes)>;
+private:
     size_t version = 0; // версия БД, увеличивается при каждом изменении
-    std::vector<std::function<void()>> changeCallbacks; // колбэки для оповещения
+    std::vector<ChangeCallback> changeCallbacks; // колбэки для оповещения
+    ChangeSet pendingChanges; // изменения, ещё не разосланные подписчикам
+    static ExternalChangeCallback externalChangeCallback;
+
+    // Разница между содержимым файла до и после перезаписи извне (по id)
+    static ChangeSet diffTables(const CachedTable& before, const CachedTable& after);
+    static bool sameRecord(const Student& a, const Student& b);
+
+    // Применить к своим записям содержимое файла, перечитанное после записи извне или сохранённое другим
+    // экземпляром процесса (перед каждой командой)
+    void syncWithFile();
+
+    // Транзакция (begin/commit/rollback): изменения копятся в памяти сеанса, а сортировка,
+    // перестроение индексов, запись файла и оповещение выполняются один раз при commit
+    bool inTransaction = false;
+    bool indexesDirty = false;          // индексы устарели (в транзакции перестраиваются перед первым чтением)
+    std::vector<Student> txnSnapshot;   // записи на момент begin (для rollback)
+    int txnNextId = 1;                  // nextId на момент begin
 
     // -------------------------------------------------- Приватные функции-помощники --------------------------------------------------
-    // Загрузка БД из файла
-    void loadFromFile(const std::wstring& filename);
+    // Загрузка БД из файла (false — файл не открылся, записи не тронуты)
+    bool loadFromFile(const std::wstring& filename);
 
-    // Сохранение БД в файл
+    // Сохранение БД в файл: снимок строк готовится сразу, запись на диск и оповещение — в фоне
     void saveToFile(const std::wstring& filename);
 
-    // Парсинг критериев из команды
-    // (строка "name=Кузьмин* group=101-103" разобьется на пары ключ-значение: [field]: value (["name"]: "Кузьмин*", ["group"]: "101-103"))
-    std::map<std::wstring, std::wstring> parseCriteria(const std::wstring& command) const;
+    // Забрать накопленные изменения для подписчиков (с новыми строками записей) и увеличить версию
+    ChangeSet takeChanges();
+
+    // Критерии команды по полям схемы ("name=Кузьмин* group=101,105 or not rating=2-3";
+    // range= — диапазон вывода page, не критерий).
+    // false — ошибка в команде (она уже выведена, если report), команду выполнять нельзя
+    static bool compileCriteria(std::string_view command, Criteria& criteria, bool report = true);
+
+    // Проверка соответствия записи критериям (хотя бы одной ветке)
+    static bool matchesCriteria(const Student& student, const Criteria& criteria);
+
+    // Запись подходит под все условия ветки
+    static bool matchesBranch(const Student& student, const Criteria& criteria, size_t branch);
+
+    // Запись подходит под условие (любое значение списка; с not — ни одно)
+    static bool matchesPredicate(const Student& student, const Criteria& criteria, const Predicate& predicate);
+
+    // Перестроение индексов (eager — сразу, остальные — в фоне) и сброс выборки на все записи
+    void rebuildIndexes();
+
+    // Перестроить индексы, устаревшие в транзакции, перед чтением (выборка сохраняется)
+    void refreshIndexes();
+
+    // Построение одного индекса по текущим записям
+    void buildIndex(IndexKind kind);
+
+    // Дождаться фонового построения индексов (перед любым изменением записей)
+    void waitIndexBuilder();
+
+    // Построить индекс сейчас, если он ещё не готов (для запросов, которым нужен порядок индекса)
+    void ensureIndex(IndexKind kind);
+
+    // Ограничивает ли критерий выборку по индексу (поле с индексом, не *, без * в середине маски ФИО; у info — только слово)
+    static bool indexedCriterion(const Criterion& criterion);
+
+    // Завершение изменения: сортировка (если нужна), индексы и запись файла; в транзакции — только сброс выборки
+    void applyChanges(bool resort);
+
+    // Поиск записи по id через прямой массив (students.size(), если записи нет)
+    size_t findById(int id) const;
+
+    // Диапазон позиций [lo, hi) в порядке индекса поля (id, name, group, rating) для значения критерия;
+    // для info=~слово — позиции в списках слов словаря (у начала слова записи разных слов могут повторяться)
+    // (false — критерий индексом не ограничивается: *, маска с * в середине, поле без индекса)
+    bool indexRange(const Criterion& criterion, size_t& lo, size_t& hi) const;
+
+    // Номер записи на позиции pos в порядке индекса
+    size_t indexRow(int kind, size_t pos) const;
+
+    // Номера записей (по возрастанию), подходящих под критерии; выборку не меняет
+    RowList selectRows(const Criteria& criteria) const;
+
+    // Номера записей (по возрастанию) одной ветки критериев
+    RowList selectBranch(const Criteria& criteria, size_t branch) const;
 
-    // Проверка соответствия записи критериям (тем самым парам ключ-значение)
-    bool matchesCriteria(const Student& student, const std::map<std::wstring, std::wstring>& criteria) const;
+    // Оценка числа записей, которые пройдёт выборка по критериям (без выполнения и без вывода ошибок)
+    size_t estimateRows(std::string_view command) const;
+
+    // Записи для update/remove ... where: условия разбираются и выбираются по индексам прямо перед изменением
+    // (false — ошибка в условиях, она уже выведена)
+    bool whereRows(std::string_view condition, RowList& rows);
+
+    // Номера полей из начала списка print ("name group range=1-10" — name, group)
+    static std::pmr::vector<int> printFields(std::string_view fields);
+
+    // Строка записи по номерам полей в буфер UTF-8 (пустой список — все поля, как в файле)
+    static void appendRow(std::string& out, const Student& student, const std::pmr::vector<int>& fields);
+
+    // Строки выбранных записей для print в буфер UTF-8
+    void formatPrint(std::string_view fields, std::string& out) const;
+
+    // Фильтрация кандидатов проверкой matches(номер записи) с сохранением порядка
+    // (выше порога parallelThreshold — морселями на пуле потоков)
+    template <typename Rows, typename Matches> RowList filterRows(const Rows& rows, const Matches& matches) const;
+
+    static size_t parallelThreshold; // с какого числа записей включается параллельное выполнение
+
+public:
+    // Настройка параллельного выполнения (вызывать до первого запроса, значения из server_config.ini)
+    static void setParallelism(size_t threshold, size_t threads);
+
+    // Какие индексы строить сразу ("id,name,group,rating", "all" или "none"), остальные — в фоне или при первом обращении
+    static void setIndexing(const std::string& eager, bool background);
+
+    // Бюджет памяти кэша загруженных файлов в байтах (0 — без кэша)
+    static void setCacheBudget(size_t bytes);
+
+    // Следить за открытыми файлами (inotify): записи другого процесса применяются к экземплярам разницей по id
+    static void setWatching(bool enabled);
+    static void onExternalChange(ExternalChangeCallback callback);
+    // Ключ файла в реестре (его получает onExternalChange): полный путь (или путь как есть, если файла нет)
+    static std::string fileKey(const std::string& path);
+
+    // Память по открытым файлам, состояние кэша и арен запросов
+    static void printMemory();                                        // memory
+
+    ~Database();
 
 public:
     size_t getVersion() const;
     void clearCallbacks();
-    void notifyOnChange(std::function<void()> callback);
+    void notifyOnChange(ChangeCallback callback);
     void notifyChanged();
 
 public:
     // Сортировка записей по очереди: group, name, rating, info
     void sort();
 
-    // Выполнение команды из строки
-    void parseCommand(const std::wstring& full_command);
+    // Выполнение команды из строки (false — команда не выполнена: ошибка в ней или в данных)
+    bool parseCommand(std::string_view full_command);
+
+    // Оценка стоимости команды в записях, которые она пройдёт (для планировщика запросов сервера): по ширине диапазонов
+    // индексов, без выполнения и без вывода. Изменение вне транзакции стоит всех записей (сортировка, индексы, файл);
+    // open сервер выполняет сам и оценивает по размеру файла
+    size_t estimateCost(std::string_view full_command) const;
+
+    // Быстрый путь print без форматирования: если выбраны все записи без сортировки, а файл на диске
+    // совпадает с памятью, открывает файл и возвращает дескриптор и байтовый диапазон строк для отдачи как есть.
+    // Иначе -1 (тогда print выполняется обычным образом)
+    int openRawPrint(std::string_view fields, off_t& offset, size_t& length) const;
 
     // -------------------------------------------------- Работа с файлом БД --------------------------------------------------
     // Выбор файла базы данных
-    void selectDB(const std::wstring& filename);                      // open       <название файла>
+    bool selectDB(const std::wstring& filename);                      // open       <название файла>
 
-    // Сохранение базы данных
-    void saveDB();                                                    // save
+    // Сохранение базы данных (wait — дождаться записи на диск)
+    bool saveDB(const std::wstring& args);                            // save       [wait]
 
     // -------------------------------------------------- Выборка из данных --------------------------------------------------
     // Выборка записей
-    void select(const std::wstring& command);                         // select     <id=<...>, name=<...>, group=<...>, rating=<...>>
+    bool select(std::string_view command);                            // select     <id=<...>, name=<...>, group=<...>, rating=<...>>
 
     // Повторная выборка среди выбранных записей
-    void reselect(const std::wstring& command);                       // reselect   <id=<...>, <name=<...>, group=<...>, rating=<...>>
+    bool reselect(std::string_view command);                          // reselect   <id=<...>, <name=<...>, group=<...>, rating=<...>>
 
     // Вывод выбранных записей
-    void print(const std::wstring& fields) const;                     // print      <name, group, rating, info> [sort <name/group/rating>]
+    void print(std::string_view fields) const;                        // print      <name, group, rating, info> [sort <name/group/rating>]
+    // print сразу в буфер UTF-8 (сервер отправляет его без перекодирования); прочие сообщения — в wcout
+    void printInto(std::string_view fields, std::string& out);
 
-    // Редактирование выбранных записей (всех)
-    void update(const std::wstring& command);                         // update     <name=<...>, group=<...>, rating=<...>>
+    // Подсчёт записей по критериям без изменения выборки (по одному индексу — за O(log n))
+    bool count(std::string_view command) const;                       // count      [id=<...>, name=<...>, group=<...>, rating=<...>]
 
-    // Удаление выбранных записей
-    void remove();                                                    // remove
+    // Страница записей в порядке индекса без построения выборки (O(log n + размер страницы))
+    bool page(std::string_view command);                        // page       <id/name/group/rating> [range=<...>] [критерии]
+
+    // Редактирование выбранных записей (всех) или, с where, записей по условиям без выборки
+    bool update(std::string_view command);                            // update     <name=<...>, group=<...>, rating=<...>> [where <условия>]
+
+    // Удаление выбранных записей или, с where, записей по условиям без выборки
+    bool remove(std::string_view command);                            // remove     [where <условия>]
+
+    // -------------------------------------------------- Транзакции --------------------------------------------------
+    // Начало транзакции
+    bool begin();                                                     // begin
+
+    // Применение накопленных изменений: одна сортировка, одно перестроение индексов, одна запись и одно оповещение
+    bool commit();                                                    // commit
+
+    // Отмена накопленных изменений (файл не трогается)
+    bool rollback();                                                  // rollback
 
     // Добавление записи
-    void add(const std::wstring& command);                            // add        <фио>\t<группа>\t<оценка>\t<инфа>
+    bool add(const std::wstring& command);                            // add        <фио>\t<группа>\t<оценка>\t<инфа>
+
+    // Добавление записи из готовых полей (false — поле не прошло проверку, ошибка выводится как у add)
+    bool addStudent(const std::wstring& name, int group, double rating, const std::wstring& info);
+
+    // -------------------------------------------------- Доступ из программ (libsubd) --------------------------------------------------
+    // Запись для чтения без копирования: строки указывают прямо в записи БД и действительны до следующего изменения
+    struct RowView {
+        int id;
+        const wchar_t* name;
+        int group;
+        double rating;
+        const wchar_t* info;
+    };
+
+    // Номера записей по критериям, как у select, но без вывода и без изменения выборки (false — ошибка в критериях)
+    bool query(std::string_view criteria, std::vector<size_t>& rows);
+
+    // Запись по номеру из query
+    RowView row(size_t index) const;
+
+    // Идёт ли транзакция
+    bool transactionOpen() const { return inTransaction; }
 };
 
 /// Допустимые команды и их использование:
@@ -149,13 +814,21 @@ public:
 ///    | Команда   | Сигнатура                                                                | Описание                                                      |
 ///    +-----------+--------------------------------------------------------------------------+---------------------------------------------------------------+
 ///    | open      | <название файла>                                                         | Выбор файла базы данных                                       |
-///    | save      |                                                                          | Сохранение базы данных                                        |
+///    | save      | [wait]                                                                   | Сохранение базы данных (wait — дождаться записи на диск)      |
 ///    | select    | [id=<...> name=<...>, group=<...>, rating=<...>]                         | Выборка записей                                               |
 ///    | reselect  | [id=<...> name=<...>, group=<...>, rating=<...>]                         | Повторная выборка среди выбранных записей                     |
-///    | update    | <name=<...>, group=<...>, rating=<...>, info=<...>>                      | Редактирование выбранных записей (всех)                       |
-///    | remove    |                                                                          | Удаление выбранных записей                                    |
+///    | update    | <name=<...>, group=<...>, rating=<...>, info=<...>> [where <...>]        | Редактирование выбранных записей (всех) или по where          |
+///    | remove    | [where <...>]                                                            | Удаление выбранных записей или записей по where               |
+///    | begin     |                                                                          | Начало транзакции                                             |
+///    | commit    |                                                                          | Применение изменений транзакции (одна запись и оповещение)    |
+///    | rollback  |                                                                          | Отмена изменений транзакции                                   |
 ///    | add       | <фио>\t<группа>\t<оценка>\t<инфа>                                        | Добавление записи                                             |
 ///    | print     | [id, name, group, rating, info] [range=<...>] [sort <name/group/rating>] | Вывод выбранных записей                                       |
+///    | count     | [id=<...> name=<...>, group=<...>, rating=<...>]                         | Подсчёт записей без изменения выборки                         |
+///    | page      | <id/name/group/rating> [range=<...>] [id=<...> name=<...> ...]           | Страница записей в порядке поля без изменения выборки         |
+///    | memory    |                                                                          | Память по открытым файлам, кэш и арены запросов сервера       |
+///    | cancel    |                                                                          | Прервать выполняющийся запрос клиента (сервер)                |
+///    | trace     | on/off                                                                   | Трассировка запросов клиента в trace_file (сервер)            |
 ///    +-----------+--------------------------------------------------------------------------+---------------------------------------------------------------+
 
 /// Пример допустимых значений для поиска по полям (select, reselect, update, remove):
@@ -171,6 +844,11 @@ public:
 ///    +--------+---+-------+--------------+-----------+-----------------------------+
 ///    | rating | * |   4   |      4-5     |    *-4    |             4-*             |
 ///    +--------+---+-------+--------------+-----------+-----------------------------+
+/// 
+/// Условия через пробел должны выполняться все; список через запятую — любое из значений (group=101,105,220);
+/// not перед условием — отрицание (not rating=2-3); or разделяет ветки: подходит запись, подходящая под любую из них
+/// (group=101 rating=5 or group=105 not info="")
+/// Слово в info без учёта регистра — info=~олимпиад, начало слова — info=~олимп* (по словарю слов info)
 
 /// Описание полей для студента:
 /// 